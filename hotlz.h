@@ -0,0 +1,174 @@
+//Header-only block compression
+//LZ77 with a single hash probe per position, byte aligned sequences and 64 KiB of history
+//Meant to be fast rather than small, logs still shrink several times
+
+#ifndef HOTLZ_H_
+#define HOTLZ_H_
+#include <stddef.h>
+
+// ----------------------------------------------------
+// Hlz
+// ----------------------------------------------------
+// A block is a list of sequences:
+//  token: literal count << 4 | (match length - 4), 15 means more length bytes follow
+//  [length bytes] literals [offset (2 bytes, little endian)] [length bytes]
+// The last sequence only has literals
+
+// Biggest size compressing `size` bytes can produce
+size_t hlz_bound(size_t size);
+
+// Compress into `destination`, that must hold hlz_bound(size) bytes. Return the compressed size
+size_t hlz_compress(const char* source, size_t size, char* destination);
+
+// Return 1 if the block decompressed to exactly `capacity` bytes, 0 if it is corrupted
+int hlz_decompress(const char* source, size_t size, char* destination, size_t capacity);
+
+#endif // HOTLZ_H_
+
+#ifdef HOTLZ_IMPLEMENTATION
+
+#include <stdint.h>
+#include <string.h>
+
+#define HLZ_HASH_BITS 14
+#define HLZ_MIN_MATCH 4
+#define HLZ_MAX_OFFSET 65535
+// Matches never get this close to the end, so the last sequence always has literals
+#define HLZ_LAST_LITERALS 5
+
+static uint32_t hlz_read32(const unsigned char* p) {
+  uint32_t value;
+  memcpy(&value, p, sizeof(value));
+  return value;
+}
+
+static uint32_t hlz_hash(uint32_t value) {
+  return (value * 2654435761u) >> (32 - HLZ_HASH_BITS);
+}
+
+static unsigned char* hlz_put_length(unsigned char* destination, size_t length) {
+  while (length >= 255) {
+    *destination++ = 255;
+    length -= 255;
+  }
+  *destination++ = (unsigned char) length;
+  return destination;
+}
+
+static unsigned char* hlz_put_sequence(unsigned char* destination, const unsigned char* literals, size_t count, size_t offset, size_t match) {
+  unsigned char* token = destination++;
+  *token = (count >= 15 ? 15 : count) << 4;
+  if (count >= 15) destination = hlz_put_length(destination, count - 15);
+
+  memcpy(destination, literals, count);
+  destination += count;
+
+  if (!match) return destination;
+
+  *destination++ = offset & 0xff;
+  *destination++ = offset >> 8;
+
+  match -= HLZ_MIN_MATCH;
+  *token |= match >= 15 ? 15 : match;
+  if (match >= 15) destination = hlz_put_length(destination, match - 15);
+
+  return destination;
+}
+
+size_t hlz_bound(size_t size) {
+  return size + size / 255 + 16;
+}
+
+size_t hlz_compress(const char* source, size_t size, char* destination) {
+  const unsigned char* src = (const unsigned char*) source;
+  unsigned char* dst = (unsigned char*) destination;
+  uint32_t table[1 << HLZ_HASH_BITS] = {0};
+
+  size_t anchor = 0;
+  size_t i = 1;
+  size_t misses = 0;
+  size_t limit = size > HLZ_LAST_LITERALS + HLZ_MIN_MATCH ? size - HLZ_LAST_LITERALS - HLZ_MIN_MATCH : 0;
+
+  while (i < limit) {
+    uint32_t value = hlz_read32(src + i);
+    uint32_t hash = hlz_hash(value);
+    size_t candidate = table[hash];
+    table[hash] = (uint32_t) i;
+
+    if (i - candidate > HLZ_MAX_OFFSET || hlz_read32(src + candidate) != value) {
+      // Data that doesn't compress is skipped faster and faster
+      i += 1 + (misses++ >> 6);
+      continue;
+    }
+    misses = 0;
+
+    while (i > anchor && candidate > 0 && src[i - 1] == src[candidate - 1]) {
+      i--;
+      candidate--;
+    }
+
+    size_t length = HLZ_MIN_MATCH;
+    while (i + length < size - HLZ_LAST_LITERALS && src[i + length] == src[candidate + length]) length++;
+
+    dst = hlz_put_sequence(dst, src + anchor, i - anchor, i - candidate, length);
+    i += length;
+    anchor = i;
+  }
+
+  dst = hlz_put_sequence(dst, src + anchor, size - anchor, 0, 0);
+  return dst - (unsigned char*) destination;
+}
+
+static int hlz_get_length(const unsigned char** source, const unsigned char* end, size_t* length) {
+  unsigned char byte;
+  do {
+    if (*source >= end) return 0;
+    byte = *(*source)++;
+    *length += byte;
+  } while (byte == 255);
+  return 1;
+}
+
+int hlz_decompress(const char* source, size_t size, char* destination, size_t capacity) {
+  const unsigned char* src = (const unsigned char*) source;
+  const unsigned char* end = src + size;
+  unsigned char* dst = (unsigned char*) destination;
+  size_t written = 0;
+
+  while (src < end) {
+    unsigned char token = *src++;
+
+    size_t count = token >> 4;
+    if (count == 15 && !hlz_get_length(&src, end, &count)) return 0;
+    if (count > (size_t) (end - src) || count > capacity - written) return 0;
+
+    memcpy(dst + written, src, count);
+    src += count;
+    written += count;
+
+    if (src == end) break;
+
+    if (end - src < 2) return 0;
+    size_t offset = src[0] | (src[1] << 8);
+    src += 2;
+
+    size_t match = token & 15;
+    if (match == 15 && !hlz_get_length(&src, end, &match)) return 0;
+    match += HLZ_MIN_MATCH;
+
+    if (offset == 0 || offset > written || match > capacity - written) return 0;
+
+    unsigned char* from = dst + written - offset;
+    if (offset >= match) {
+      memcpy(dst + written, from, match);
+    } else {
+      // Overlapping, the copy repeats the last `offset` bytes
+      for (size_t j = 0; j < match; j++) dst[written + j] = from[j];
+    }
+    written += match;
+  }
+
+  return written == capacity;
+}
+
+#endif // HOTLZ_IMPLEMENTATION
@@ -0,0 +1,989 @@
+//Header-only regular expressions
+//Compiled to a NFA once, then matched by a DFA built lazily while scanning
+//One table lookup per byte and no backtracking, so matching is always linear
+
+#ifndef HOTRE_H_
+#define HOTRE_H_
+#include <stdint.h>
+#include <stddef.h>
+
+// ----------------------------------------------------
+// Hre
+// ----------------------------------------------------
+// Supported syntax:
+//  literals, .  [abc] [^a-z]  \d \w \s \D \W \S  \t \n \r  \\ \. ...
+//  (group) (?:group)  a|b  * + ?  {m} {m,} {m,n}  ^ $
+// Matching works on bytes, a match is taken from its leftmost start and is as long as it goes
+typedef struct Hre Hre;
+
+// Return NULL and set error when the pattern is invalid
+Hre* hre_compile(const char* pattern, size_t size, const char** error);
+void hre_free(Hre* re);
+
+// Return 1 if there is a match anywhere in text
+int hre_search(Hre* re, const char* text, size_t size);
+
+// Find the first match ending at or after `from`, taken from its leftmost start
+// and made as long as it goes. ^ and $ are always relative to the whole text
+// Return 1 and set [start, end) when found
+int hre_find(Hre* re, const char* text, size_t size, size_t from, size_t* start, size_t* end);
+
+#endif // HOTRE_H_
+
+#ifdef HOTRE_IMPLEMENTATION
+
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <pthread.h>
+#include <stdatomic.h>
+
+// Counted repetitions are expanded, this keeps a{1000}{1000} from eating the memory
+#define HRE_MAX_NODES 20000
+// The DFA cache is thrown away when it gets bigger than this, scanning just goes on
+#define HRE_MAX_STATES 2048
+
+// ----------------------------------------------------
+// Parser
+// ----------------------------------------------------
+typedef enum {
+  HRE_AST_EMPTY,
+  HRE_AST_SET,
+  HRE_AST_CAT,
+  HRE_AST_ALT,
+  HRE_AST_STAR,
+  HRE_AST_PLUS,
+  HRE_AST_QUEST,
+  HRE_AST_REPEAT,
+  HRE_AST_BOL,
+  HRE_AST_EOL,
+} Hre_Ast_Type;
+
+typedef struct {
+  uint32_t bits[8];
+} Hre_Set;
+
+typedef struct {
+  Hre_Ast_Type type;
+  int left;
+  int right;
+  int min;
+  int max; // -1 means no upper bound
+  Hre_Set set;
+} Hre_Ast;
+
+typedef struct {
+  const char* pattern;
+  size_t size;
+  size_t cursor;
+  Hre_Ast* nodes;
+  size_t count;
+  size_t capacity;
+  const char* error;
+} Hre_Parser;
+
+static void hre_set_add(Hre_Set* set, uint8_t c) {
+  set->bits[c >> 5] |= 1u << (c & 31);
+}
+
+static int hre_set_has(const Hre_Set* set, uint8_t c) {
+  return (set->bits[c >> 5] >> (c & 31)) & 1;
+}
+
+static void hre_set_add_range(Hre_Set* set, uint8_t from, uint8_t to) {
+  for (int c = from; c <= to; c++) hre_set_add(set, (uint8_t) c);
+}
+
+static void hre_set_invert(Hre_Set* set) {
+  for (size_t i = 0; i < 8; i++) set->bits[i] = ~set->bits[i];
+}
+
+static void hre_set_merge(Hre_Set* set, const Hre_Set* other) {
+  for (size_t i = 0; i < 8; i++) set->bits[i] |= other->bits[i];
+}
+
+static int hre_ast_new(Hre_Parser* parser, Hre_Ast_Type type) {
+  if (parser->count >= parser->capacity) {
+    parser->capacity = parser->capacity ? parser->capacity * 2 : 64;
+    parser->nodes = realloc(parser->nodes, parser->capacity * sizeof(Hre_Ast));
+    assert(parser->nodes && "Out of memory");
+  }
+
+  parser->nodes[parser->count] = (Hre_Ast) {
+    .type = type,
+    .left = -1,
+    .right = -1,
+  };
+  return parser->count++;
+}
+
+static int hre_ast_binary(Hre_Parser* parser, Hre_Ast_Type type, int left, int right) {
+  int node = hre_ast_new(parser, type);
+  parser->nodes[node].left = left;
+  parser->nodes[node].right = right;
+  return node;
+}
+
+static int hre_parser_done(Hre_Parser* parser) {
+  return parser->cursor >= parser->size;
+}
+
+static char hre_parser_peek(Hre_Parser* parser) {
+  return parser->pattern[parser->cursor];
+}
+
+/*
+ * Class escapes like \d, return 0 if c isn't one
+ */
+static int hre_class_escape(char c, Hre_Set* set) {
+  Hre_Set result = {0};
+  switch (c) {
+    case 'd': case 'D':
+      hre_set_add_range(&result, '0', '9');
+      break;
+    case 'w': case 'W':
+      hre_set_add_range(&result, '0', '9');
+      hre_set_add_range(&result, 'a', 'z');
+      hre_set_add_range(&result, 'A', 'Z');
+      hre_set_add(&result, '_');
+      break;
+    case 's': case 'S':
+      hre_set_add(&result, ' ');
+      hre_set_add_range(&result, '\t', '\r');
+      break;
+    default:
+      return 0;
+  }
+
+  if (c == 'D' || c == 'W' || c == 'S') hre_set_invert(&result);
+  hre_set_merge(set, &result);
+  return 1;
+}
+
+static uint8_t hre_literal_escape(char c) {
+  switch (c) {
+    case 't': return '\t';
+    case 'n': return '\n';
+    case 'r': return '\r';
+    case 'f': return '\f';
+    case 'v': return '\v';
+    case 'e': return '\x1b';
+    default: return (uint8_t) c;
+  }
+}
+
+static int hre_parse_alternation(Hre_Parser* parser);
+
+static int hre_parse_class(Hre_Parser* parser) {
+  int node = hre_ast_new(parser, HRE_AST_SET);
+  Hre_Set set = {0};
+  int negate = 0;
+
+  if (!hre_parser_done(parser) && hre_parser_peek(parser) == '^') {
+    negate = 1;
+    parser->cursor++;
+  }
+
+  int first = 1;
+  while (1) {
+    if (hre_parser_done(parser)) {
+      parser->error = "missing ]";
+      return -1;
+    }
+
+    char c = parser->pattern[parser->cursor++];
+    if (c == ']' && !first) break;
+    first = 0;
+
+    uint8_t low = (uint8_t) c;
+    if (c == '\\') {
+      if (hre_parser_done(parser)) {
+        parser->error = "trailing \\";
+        return -1;
+      }
+      char escaped = parser->pattern[parser->cursor++];
+      if (hre_class_escape(escaped, &set)) continue;
+      low = hre_literal_escape(escaped);
+    }
+
+    // A range, unless the - is the last thing in the class
+    if (parser->cursor + 1 < parser->size && hre_parser_peek(parser) == '-' && parser->pattern[parser->cursor + 1] != ']') {
+      parser->cursor++;
+      uint8_t high = (uint8_t) parser->pattern[parser->cursor++];
+      if (high == '\\' && !hre_parser_done(parser)) high = hre_literal_escape(parser->pattern[parser->cursor++]);
+      if (high < low) {
+        parser->error = "invalid range";
+        return -1;
+      }
+      hre_set_add_range(&set, low, high);
+    } else {
+      hre_set_add(&set, low);
+    }
+  }
+
+  if (negate) hre_set_invert(&set);
+  parser->nodes[node].set = set;
+  return node;
+}
+
+static int hre_parse_atom(Hre_Parser* parser) {
+  char c = parser->pattern[parser->cursor++];
+
+  if (c == '(') {
+    if (parser->cursor + 1 < parser->size && hre_parser_peek(parser) == '?' && parser->pattern[parser->cursor + 1] == ':') {
+      parser->cursor += 2;
+    }
+    int inner = hre_parse_alternation(parser);
+    if (inner < 0) return -1;
+    if (hre_parser_done(parser) || hre_parser_peek(parser) != ')') {
+      parser->error = "missing )";
+      return -1;
+    }
+    parser->cursor++;
+    return inner;
+  }
+
+  if (c == '[') return hre_parse_class(parser);
+  if (c == '^') return hre_ast_new(parser, HRE_AST_BOL);
+  if (c == '$') return hre_ast_new(parser, HRE_AST_EOL);
+
+  if (c == '*' || c == '+' || c == '?' || c == '{') {
+    parser->error = "nothing to repeat";
+    return -1;
+  }
+
+  int node = hre_ast_new(parser, HRE_AST_SET);
+  Hre_Set* set = &parser->nodes[node].set;
+
+  if (c == '.') {
+    hre_set_invert(set);
+  } else if (c == '\\') {
+    if (hre_parser_done(parser)) {
+      parser->error = "trailing \\";
+      return -1;
+    }
+    char escaped = parser->pattern[parser->cursor++];
+    if (!hre_class_escape(escaped, set)) hre_set_add(set, hre_literal_escape(escaped));
+  } else {
+    hre_set_add(set, (uint8_t) c);
+  }
+
+  return node;
+}
+
+static int hre_parse_number(Hre_Parser* parser, int* value) {
+  size_t start = parser->cursor;
+  long result = 0;
+  while (!hre_parser_done(parser) && hre_parser_peek(parser) >= '0' && hre_parser_peek(parser) <= '9') {
+    result = result * 10 + (hre_parser_peek(parser) - '0');
+    if (result > HRE_MAX_NODES) result = HRE_MAX_NODES;
+    parser->cursor++;
+  }
+  *value = (int) result;
+  return parser->cursor > start;
+}
+
+/*
+ * {m} {m,} {m,n}, a { that doesn't look like that is a literal
+ */
+static int hre_parse_counted(Hre_Parser* parser, int* min, int* max) {
+  size_t start = parser->cursor;
+  parser->cursor++;
+
+  if (!hre_parse_number(parser, min)) {
+    parser->cursor = start;
+    return 0;
+  }
+
+  *max = *min;
+  if (!hre_parser_done(parser) && hre_parser_peek(parser) == ',') {
+    parser->cursor++;
+    if (!hre_parse_number(parser, max)) *max = -1;
+  }
+
+  if (hre_parser_done(parser) || hre_parser_peek(parser) != '}') {
+    parser->cursor = start;
+    return 0;
+  }
+  parser->cursor++;
+  return 1;
+}
+
+static int hre_parse_repetition(Hre_Parser* parser) {
+  int atom;
+  if (hre_parser_peek(parser) == '{') {
+    // A lonely { is taken literally
+    int min, max;
+    size_t start = parser->cursor;
+    if (hre_parse_counted(parser, &min, &max)) {
+      parser->error = "nothing to repeat";
+      return -1;
+    }
+    parser->cursor = start + 1;
+    atom = hre_ast_new(parser, HRE_AST_SET);
+    hre_set_add(&parser->nodes[atom].set, '{');
+  } else {
+    atom = hre_parse_atom(parser);
+  }
+  if (atom < 0) return -1;
+
+  while (!hre_parser_done(parser)) {
+    char c = hre_parser_peek(parser);
+    int node;
+    if (c == '*') {
+      node = hre_ast_binary(parser, HRE_AST_STAR, atom, -1);
+      parser->cursor++;
+    } else if (c == '+') {
+      node = hre_ast_binary(parser, HRE_AST_PLUS, atom, -1);
+      parser->cursor++;
+    } else if (c == '?') {
+      node = hre_ast_binary(parser, HRE_AST_QUEST, atom, -1);
+      parser->cursor++;
+    } else if (c == '{') {
+      int min, max;
+      if (!hre_parse_counted(parser, &min, &max)) break;
+      if (max >= 0 && max < min) {
+        parser->error = "invalid repetition";
+        return -1;
+      }
+      node = hre_ast_binary(parser, HRE_AST_REPEAT, atom, -1);
+      parser->nodes[node].min = min;
+      parser->nodes[node].max = max;
+    } else {
+      break;
+    }
+
+    // Lazy quantifiers make no difference for a leftmost-longest DFA
+    if (!hre_parser_done(parser) && hre_parser_peek(parser) == '?' && c != '?') parser->cursor++;
+    atom = node;
+  }
+
+  return atom;
+}
+
+static int hre_parse_concatenation(Hre_Parser* parser) {
+  int result = -1;
+
+  while (!hre_parser_done(parser) && hre_parser_peek(parser) != '|' && hre_parser_peek(parser) != ')') {
+    int node = hre_parse_repetition(parser);
+    if (node < 0) return -1;
+    result = result < 0 ? node : hre_ast_binary(parser, HRE_AST_CAT, result, node);
+  }
+
+  return result < 0 ? hre_ast_new(parser, HRE_AST_EMPTY) : result;
+}
+
+static int hre_parse_alternation(Hre_Parser* parser) {
+  int result = hre_parse_concatenation(parser);
+  if (result < 0) return -1;
+
+  while (!hre_parser_done(parser) && hre_parser_peek(parser) == '|') {
+    parser->cursor++;
+    int node = hre_parse_concatenation(parser);
+    if (node < 0) return -1;
+    result = hre_ast_binary(parser, HRE_AST_ALT, result, node);
+  }
+
+  return result;
+}
+
+// ----------------------------------------------------
+// NFA
+// ----------------------------------------------------
+typedef enum {
+  HRE_OP_SET,
+  HRE_OP_SPLIT,
+  HRE_OP_BOL,
+  HRE_OP_EOL,
+  HRE_OP_MATCH,
+} Hre_Op;
+
+typedef struct {
+  Hre_Op op;
+  int out;
+  int out1;
+  int set;
+} Hre_Node;
+
+typedef struct {
+  Hre_Node* nodes;
+  size_t count;
+  size_t capacity;
+  Hre_Set* sets;
+  size_t sets_count;
+  size_t sets_capacity;
+  int start;
+  // Repetitions of empty groups don't create nodes, this bounds them too
+  size_t steps;
+} Hre_Program;
+
+static int hre_node_new(Hre_Program* program, Hre_Op op, int out, int out1) {
+  if (program->count >= HRE_MAX_NODES) return -1;
+
+  if (program->count >= program->capacity) {
+    program->capacity = program->capacity ? program->capacity * 2 : 64;
+    program->nodes = realloc(program->nodes, program->capacity * sizeof(Hre_Node));
+    assert(program->nodes && "Out of memory");
+  }
+
+  program->nodes[program->count] = (Hre_Node) {
+    .op = op,
+    .out = out,
+    .out1 = out1,
+    .set = -1,
+  };
+  return program->count++;
+}
+
+static int hre_set_new(Hre_Program* program, const Hre_Set* set) {
+  if (program->sets_count >= program->sets_capacity) {
+    program->sets_capacity = program->sets_capacity ? program->sets_capacity * 2 : 16;
+    program->sets = realloc(program->sets, program->sets_capacity * sizeof(Hre_Set));
+    assert(program->sets && "Out of memory");
+  }
+
+  program->sets[program->sets_count] = *set;
+  return program->sets_count++;
+}
+
+/*
+ * Compile `ast` so that it continues to `next` once matched, return where it starts
+ * The reversed program matches the mirrored language, ^ and $ swap places
+ */
+static int hre_compile_node(Hre_Program* program, Hre_Parser* parser, int ast, int next, int reverse) {
+  if (next < 0 || ++program->steps > HRE_MAX_NODES * 8) return -1;
+  Hre_Ast node = parser->nodes[ast];
+
+  switch (node.type) {
+    case HRE_AST_EMPTY:
+      return next;
+    case HRE_AST_SET: {
+      int set = hre_set_new(program, &node.set);
+      int result = hre_node_new(program, HRE_OP_SET, next, -1);
+      if (result >= 0) program->nodes[result].set = set;
+      return result;
+    }
+    case HRE_AST_BOL:
+      return hre_node_new(program, reverse ? HRE_OP_EOL : HRE_OP_BOL, next, -1);
+    case HRE_AST_EOL:
+      return hre_node_new(program, reverse ? HRE_OP_BOL : HRE_OP_EOL, next, -1);
+    case HRE_AST_CAT:
+      if (reverse) return hre_compile_node(program, parser, node.right, hre_compile_node(program, parser, node.left, next, reverse), reverse);
+      return hre_compile_node(program, parser, node.left, hre_compile_node(program, parser, node.right, next, reverse), reverse);
+    case HRE_AST_ALT: {
+      int left = hre_compile_node(program, parser, node.left, next, reverse);
+      int right = hre_compile_node(program, parser, node.right, next, reverse);
+      if (left < 0 || right < 0) return -1;
+      return hre_node_new(program, HRE_OP_SPLIT, left, right);
+    }
+    case HRE_AST_QUEST: {
+      int body = hre_compile_node(program, parser, node.left, next, reverse);
+      if (body < 0) return -1;
+      return hre_node_new(program, HRE_OP_SPLIT, body, next);
+    }
+    case HRE_AST_STAR:
+    case HRE_AST_PLUS: {
+      int loop = hre_node_new(program, HRE_OP_SPLIT, -1, next);
+      if (loop < 0) return -1;
+      int body = hre_compile_node(program, parser, node.left, loop, reverse);
+      if (body < 0) return -1;
+      program->nodes[loop].out = body;
+      return node.type == HRE_AST_STAR ? loop : body;
+    }
+    case HRE_AST_REPEAT: {
+      int result = next;
+      if (node.max < 0) {
+        int loop = hre_node_new(program, HRE_OP_SPLIT, -1, next);
+        if (loop < 0) return -1;
+        int body = hre_compile_node(program, parser, node.left, loop, reverse);
+        if (body < 0) return -1;
+        program->nodes[loop].out = body;
+        result = loop;
+      } else {
+        // x{0,2} is (x(x)?)?
+        for (int i = node.min; i < node.max && result >= 0; i++) {
+          int body = hre_compile_node(program, parser, node.left, result, reverse);
+          if (body < 0) return -1;
+          result = hre_node_new(program, HRE_OP_SPLIT, body, next);
+        }
+      }
+      for (int i = 0; i < node.min && result >= 0; i++) {
+        result = hre_compile_node(program, parser, node.left, result, reverse);
+      }
+      return result;
+    }
+  }
+
+  return -1;
+}
+
+static void hre_program_free(Hre_Program* program) {
+  free(program->nodes);
+  free(program->sets);
+}
+
+// ----------------------------------------------------
+// Lazy DFA
+// ----------------------------------------------------
+// A state is the sorted set of NFA nodes the scan can be in, transitions are
+// only computed the first time a byte is seen in that state
+#define HRE_STATE_MATCH        1
+// Would match if the text ended here, through a pending $
+#define HRE_STATE_MATCH_AT_END 2
+
+typedef struct {
+  size_t first;
+  size_t count;
+  uint32_t hash;
+  uint8_t flags;
+} Hre_State;
+
+typedef struct {
+  const Hre_Program* program;
+  // Every position can start a match, not only the first one
+  uint8_t unanchored;
+  Hre_State* states;
+  size_t states_count;
+  size_t states_capacity;
+  int* lists;
+  size_t lists_count;
+  size_t lists_capacity;
+  int32_t* next;
+  int32_t* table;
+  size_t table_capacity;
+  int32_t start[2];
+  // Scratch space for the closure
+  int* stack;
+  int* seeds;
+  int* list;
+  uint32_t* mark;
+  uint32_t mark_generation;
+} Hre_Dfa;
+
+static void hre_dfa_init(Hre_Dfa* dfa, const Hre_Program* program, uint8_t unanchored) {
+  *dfa = (Hre_Dfa) {
+    .program = program,
+    .unanchored = unanchored,
+    .start = { -1, -1 },
+  };
+
+  // Every node is expanded once and pushes at most two more, on top of the seeds
+  dfa->stack = malloc((program->count * 3 + 2) * sizeof(int));
+  dfa->seeds = malloc((program->count + 1) * sizeof(int));
+  dfa->list = malloc((program->count + 1) * sizeof(int));
+  dfa->mark = calloc(program->count + 1, sizeof(uint32_t));
+  assert(dfa->stack && dfa->seeds && dfa->list && dfa->mark && "Out of memory");
+}
+
+static void hre_dfa_free(Hre_Dfa* dfa) {
+  free(dfa->states);
+  free(dfa->lists);
+  free(dfa->next);
+  free(dfa->table);
+  free(dfa->stack);
+  free(dfa->seeds);
+  free(dfa->list);
+  free(dfa->mark);
+  *dfa = (Hre_Dfa) {0};
+}
+
+static void hre_dfa_clear(Hre_Dfa* dfa) {
+  dfa->states_count = 0;
+  dfa->lists_count = 0;
+  dfa->start[0] = -1;
+  dfa->start[1] = -1;
+  if (dfa->table) memset(dfa->table, -1, dfa->table_capacity * sizeof(int32_t));
+}
+
+static int hre_int_compare(const void* a, const void* b) {
+  int x = *(const int*) a;
+  int y = *(const int*) b;
+  return (x > y) - (x < y);
+}
+
+/*
+ * Follow the epsilon edges from the seeds, keeping the nodes that consume a byte,
+ * the match and the $ still waiting for the end of the text
+ */
+static size_t hre_dfa_closure(Hre_Dfa* dfa, const int* seeds, size_t seeds_count, int at_bol, int at_eol) {
+  const Hre_Program* program = dfa->program;
+  size_t count = 0;
+  size_t top = 0;
+
+  if (++dfa->mark_generation == 0) {
+    memset(dfa->mark, 0, (program->count + 1) * sizeof(uint32_t));
+    dfa->mark_generation = 1;
+  }
+
+  for (size_t i = seeds_count; i > 0; i--) dfa->stack[top++] = seeds[i - 1];
+
+  while (top > 0) {
+    int id = dfa->stack[--top];
+    if (dfa->mark[id] == dfa->mark_generation) continue;
+    dfa->mark[id] = dfa->mark_generation;
+
+    const Hre_Node* node = &program->nodes[id];
+    switch (node->op) {
+      case HRE_OP_SPLIT:
+        dfa->stack[top++] = node->out1;
+        dfa->stack[top++] = node->out;
+        break;
+      case HRE_OP_BOL:
+        if (at_bol) dfa->stack[top++] = node->out;
+        break;
+      case HRE_OP_EOL:
+        if (at_eol) dfa->stack[top++] = node->out;
+        else dfa->list[count++] = id;
+        break;
+      case HRE_OP_SET:
+      case HRE_OP_MATCH:
+        dfa->list[count++] = id;
+        break;
+    }
+  }
+
+  qsort(dfa->list, count, sizeof(int), hre_int_compare);
+  return count;
+}
+
+static uint32_t hre_hash_list(const int* list, size_t count) {
+  uint32_t hash = 2166136261u;
+  for (size_t i = 0; i < count; i++) {
+    hash = (hash ^ (uint32_t) list[i]) * 16777619u;
+  }
+  return hash;
+}
+
+static void hre_dfa_grow_table(Hre_Dfa* dfa) {
+  size_t capacity = dfa->table_capacity ? dfa->table_capacity * 2 : 256;
+  int32_t* table = malloc(capacity * sizeof(int32_t));
+  assert(table && "Out of memory");
+  memset(table, -1, capacity * sizeof(int32_t));
+
+  for (size_t i = 0; i < dfa->states_count; i++) {
+    size_t slot = dfa->states[i].hash & (capacity - 1);
+    while (table[slot] >= 0) slot = (slot + 1) & (capacity - 1);
+    table[slot] = (int32_t) i;
+  }
+
+  free(dfa->table);
+  dfa->table = table;
+  dfa->table_capacity = capacity;
+}
+
+/*
+ * Return the state for the list sitting in dfa->list, creating it if needed
+ */
+static int32_t hre_dfa_state(Hre_Dfa* dfa, size_t count) {
+  const int* list = dfa->list;
+  uint32_t hash = hre_hash_list(list, count);
+
+  if (dfa->table) {
+    size_t slot = hash & (dfa->table_capacity - 1);
+    while (dfa->table[slot] >= 0) {
+      Hre_State* state = &dfa->states[dfa->table[slot]];
+      if (state->hash == hash && state->count == count && memcmp(dfa->lists + state->first, list, count * sizeof(int)) == 0) {
+        return dfa->table[slot];
+      }
+      slot = (slot + 1) & (dfa->table_capacity - 1);
+    }
+  }
+
+  if (dfa->states_count >= dfa->states_capacity) {
+    dfa->states_capacity = dfa->states_capacity ? dfa->states_capacity * 2 : 64;
+    dfa->states = realloc(dfa->states, dfa->states_capacity * sizeof(Hre_State));
+    dfa->next = realloc(dfa->next, dfa->states_capacity * 256 * sizeof(int32_t));
+    assert(dfa->states && dfa->next && "Out of memory");
+  }
+
+  if (dfa->lists_count + count > dfa->lists_capacity) {
+    while (dfa->lists_count + count > dfa->lists_capacity) {
+      dfa->lists_capacity = dfa->lists_capacity ? dfa->lists_capacity * 2 : 256;
+    }
+    dfa->lists = realloc(dfa->lists, dfa->lists_capacity * sizeof(int));
+    assert(dfa->lists && "Out of memory");
+  }
+
+  const Hre_Program* program = dfa->program;
+  uint8_t flags = 0;
+  int pending_eol = 0;
+  for (size_t i = 0; i < count; i++) {
+    if (program->nodes[list[i]].op == HRE_OP_MATCH) flags |= HRE_STATE_MATCH;
+    if (program->nodes[list[i]].op == HRE_OP_EOL) pending_eol = 1;
+  }
+
+  int32_t id = (int32_t) dfa->states_count++;
+  dfa->states[id] = (Hre_State) {
+    .first = dfa->lists_count,
+    .count = count,
+    .hash = hash,
+  };
+  memcpy(dfa->lists + dfa->lists_count, list, count * sizeof(int));
+  dfa->lists_count += count;
+  memset(dfa->next + (size_t) id * 256, -1, 256 * sizeof(int32_t));
+
+  // Ending here satisfies every pending $, check if that reaches the match
+  if (flags & HRE_STATE_MATCH) {
+    flags |= HRE_STATE_MATCH_AT_END;
+  } else if (pending_eol) {
+    size_t end_count = hre_dfa_closure(dfa, dfa->lists + dfa->states[id].first, count, 0, 1);
+    for (size_t i = 0; i < end_count; i++) {
+      if (program->nodes[dfa->list[i]].op == HRE_OP_MATCH) flags |= HRE_STATE_MATCH_AT_END;
+    }
+  }
+  dfa->states[id].flags = flags;
+
+  if ((dfa->states_count + 1) * 2 > dfa->table_capacity) {
+    hre_dfa_grow_table(dfa);
+  } else {
+    size_t slot = hash & (dfa->table_capacity - 1);
+    while (dfa->table[slot] >= 0) slot = (slot + 1) & (dfa->table_capacity - 1);
+    dfa->table[slot] = id;
+  }
+
+  return id;
+}
+
+static int32_t hre_dfa_start(Hre_Dfa* dfa, int at_bol) {
+  if (dfa->start[at_bol] < 0) {
+    int start = dfa->program->start;
+    dfa->start[at_bol] = hre_dfa_state(dfa, hre_dfa_closure(dfa, &start, 1, at_bol, 0));
+  }
+  return dfa->start[at_bol];
+}
+
+/*
+ * The slow path, first time `c` is seen in `state`
+ */
+static int32_t hre_dfa_compute(Hre_Dfa* dfa, int32_t state, uint8_t c) {
+  const Hre_Program* program = dfa->program;
+
+  // Full cache, start over keeping only the state we are in
+  if (dfa->states_count >= HRE_MAX_STATES) {
+    size_t count = dfa->states[state].count;
+    memcpy(dfa->list, dfa->lists + dfa->states[state].first, count * sizeof(int));
+    hre_dfa_clear(dfa);
+    state = hre_dfa_state(dfa, count);
+  }
+
+  Hre_State current = dfa->states[state];
+  int* seeds = dfa->seeds;
+  size_t seeds_count = 0;
+
+  for (size_t i = 0; i < current.count; i++) {
+    const Hre_Node* node = &program->nodes[dfa->lists[current.first + i]];
+    if (node->op == HRE_OP_SET && hre_set_has(&program->sets[node->set], c)) {
+      seeds[seeds_count++] = node->out;
+    }
+  }
+
+  if (dfa->unanchored) seeds[seeds_count++] = program->start;
+
+  int32_t next = hre_dfa_state(dfa, hre_dfa_closure(dfa, seeds, seeds_count, 0, 0));
+  dfa->next[(size_t) state * 256 + c] = next;
+  return next;
+}
+
+static inline int32_t hre_dfa_step(Hre_Dfa* dfa, int32_t state, uint8_t c) {
+  int32_t next = dfa->next[(size_t) state * 256 + c];
+  if (next >= 0) return next;
+  return hre_dfa_compute(dfa, state, c);
+}
+
+// ----------------------------------------------------
+// Hre
+// ----------------------------------------------------
+struct Hre {
+  // Identifies the program in the per thread caches
+  uint64_t id;
+  Hre_Program forward;
+  Hre_Program reverse;
+};
+
+// A search and a filter can use different regexes at once, each thread keeps a few
+#define HRE_CACHE_SLOTS 4
+
+typedef struct {
+  uint64_t id;
+  uint64_t used;
+  Hre_Dfa search;
+  Hre_Dfa reverse;
+  Hre_Dfa anchored;
+} Hre_Cache_Slot;
+
+// The DFAs mutate while matching, each thread gets its own
+typedef struct {
+  Hre_Cache_Slot slots[HRE_CACHE_SLOTS];
+  uint64_t clock;
+} Hre_Cache;
+
+static atomic_uint_fast64_t hre_next_id = 1;
+static pthread_key_t hre_cache_key;
+static pthread_once_t hre_cache_once = PTHREAD_ONCE_INIT;
+
+static void hre_cache_slot_free(Hre_Cache_Slot* slot) {
+  hre_dfa_free(&slot->search);
+  hre_dfa_free(&slot->reverse);
+  hre_dfa_free(&slot->anchored);
+  slot->id = 0;
+}
+
+static void hre_cache_free(void* data) {
+  Hre_Cache* cache = data;
+  for (size_t i = 0; i < HRE_CACHE_SLOTS; i++) {
+    if (cache->slots[i].id) hre_cache_slot_free(&cache->slots[i]);
+  }
+  free(cache);
+}
+
+static void hre_cache_key_create() {
+  pthread_key_create(&hre_cache_key, hre_cache_free);
+}
+
+/*
+ * Return the DFAs of `re` for this thread, the least recently used
+ * regex gives its slot up when they are all taken
+ */
+static Hre_Cache_Slot* hre_cache(Hre* re) {
+  pthread_once(&hre_cache_once, hre_cache_key_create);
+  Hre_Cache* cache = pthread_getspecific(hre_cache_key);
+
+  if (!cache) {
+    cache = calloc(1, sizeof(Hre_Cache));
+    assert(cache && "Out of memory");
+    pthread_setspecific(hre_cache_key, cache);
+  }
+
+  Hre_Cache_Slot* slot = &cache->slots[0];
+  for (size_t i = 0; i < HRE_CACHE_SLOTS; i++) {
+    if (cache->slots[i].id == re->id) {
+      cache->slots[i].used = ++cache->clock;
+      return &cache->slots[i];
+    }
+    if (cache->slots[i].used < slot->used) slot = &cache->slots[i];
+  }
+
+  if (slot->id) hre_cache_slot_free(slot);
+  slot->id = re->id;
+  slot->used = ++cache->clock;
+  hre_dfa_init(&slot->search, &re->forward, 1);
+  hre_dfa_init(&slot->reverse, &re->reverse, 0);
+  hre_dfa_init(&slot->anchored, &re->forward, 0);
+  return slot;
+}
+
+static int hre_program_build(Hre_Program* program, Hre_Parser* parser, int root, int reverse) {
+  int match = hre_node_new(program, HRE_OP_MATCH, -1, -1);
+  program->start = hre_compile_node(program, parser, root, match, reverse);
+  return program->start >= 0;
+}
+
+Hre* hre_compile(const char* pattern, size_t size, const char** error) {
+  Hre_Parser parser = {
+    .pattern = pattern,
+    .size = size,
+  };
+
+  int root = hre_parse_alternation(&parser);
+  if (root >= 0 && !hre_parser_done(&parser)) {
+    parser.error = "unmatched )";
+    root = -1;
+  }
+
+  if (root < 0) {
+    if (error) *error = parser.error;
+    free(parser.nodes);
+    return NULL;
+  }
+
+  Hre* re = calloc(1, sizeof(Hre));
+  assert(re && "Out of memory");
+  re->id = atomic_fetch_add(&hre_next_id, 1);
+
+  int built = hre_program_build(&re->forward, &parser, root, 0) && hre_program_build(&re->reverse, &parser, root, 1);
+  free(parser.nodes);
+
+  if (!built) {
+    if (error) *error = "pattern too big";
+    hre_free(re);
+    return NULL;
+  }
+
+  return re;
+}
+
+void hre_free(Hre* re) {
+  if (!re) return;
+  hre_program_free(&re->forward);
+  hre_program_free(&re->reverse);
+  free(re);
+}
+
+int hre_search(Hre* re, const char* text, size_t size) {
+  Hre_Dfa* dfa = &hre_cache(re)->search;
+  int32_t state = hre_dfa_start(dfa, 1);
+
+  for (size_t i = 0; i < size; i++) {
+    if (dfa->states[state].flags & HRE_STATE_MATCH) return 1;
+    state = hre_dfa_step(dfa, state, (uint8_t) text[i]);
+  }
+
+  return (dfa->states[state].flags & HRE_STATE_MATCH_AT_END) != 0;
+}
+
+/*
+ * The forward DFA finds where the first match ends, the reversed program run
+ * backwards from there finds where it starts, and the anchored forward DFA
+ * makes it as long as it goes. Nothing past the match is read
+ */
+int hre_find(Hre* re, const char* text, size_t size, size_t from, size_t* start, size_t* end) {
+  if (from > size) return 0;
+
+  Hre_Cache_Slot* cache = hre_cache(re);
+  Hre_Dfa* dfa = &cache->search;
+  int32_t state = hre_dfa_start(dfa, from == 0);
+  size_t first = SIZE_MAX;
+
+  for (size_t i = from; ; i++) {
+    uint8_t flags = dfa->states[state].flags;
+    if ((flags & HRE_STATE_MATCH) || (i == size && (flags & HRE_STATE_MATCH_AT_END))) {
+      first = i;
+      break;
+    }
+    if (i == size) break;
+    state = hre_dfa_step(dfa, state, (uint8_t) text[i]);
+  }
+
+  if (first == SIZE_MAX) return 0;
+
+  dfa = &cache->reverse;
+  state = hre_dfa_start(dfa, first == size);
+  size_t leftmost = SIZE_MAX;
+
+  for (size_t i = first; ; i--) {
+    uint8_t flags = dfa->states[state].flags;
+    if ((flags & HRE_STATE_MATCH) || (i == 0 && (flags & HRE_STATE_MATCH_AT_END))) leftmost = i;
+    if (i == from || dfa->states[state].count == 0) break;
+    state = hre_dfa_step(dfa, state, (uint8_t) text[i - 1]);
+  }
+
+  assert(leftmost != SIZE_MAX && "The reverse scan can't see the match the forward one found");
+
+  dfa = &cache->anchored;
+  state = hre_dfa_start(dfa, leftmost == 0);
+  size_t longest = SIZE_MAX;
+
+  for (size_t i = leftmost; ; i++) {
+    uint8_t flags = dfa->states[state].flags;
+    if ((flags & HRE_STATE_MATCH) || (i == size && (flags & HRE_STATE_MATCH_AT_END))) longest = i;
+    if (i == size || dfa->states[state].count == 0) break;
+    state = hre_dfa_step(dfa, state, (uint8_t) text[i]);
+  }
+
+  assert(longest != SIZE_MAX && "The forward scan can't see the match the reverse one found");
+  *start = leftmost;
+  *end = longest;
+  return 1;
+}
+
+#endif // HOTRE_IMPLEMENTATION
@@ -18,6 +18,9 @@
 #include <signal.h>
 #include <assert.h>
 #include <errno.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#endif
 
 // ----------------------------------------------------
 // Hui_Window
@@ -34,12 +37,68 @@ typedef struct {
   size_t y;
 } Hui_Window;
 
+// ----------------------------------------------------
+// Hui_Attr
+// ----------------------------------------------------
+// Colours are the terminal default, one of the 256 indexed ones or 24 bit rgb
+#define HUI_COLOR_DEFAULT 0
+#define HUI_COLOR_INDEXED(i) (0x01000000u | (uint8_t) (i))
+#define HUI_COLOR_RGB(r, g, b) (0x02000000u | ((uint32_t) (uint8_t) (r) << 16) | ((uint32_t) (uint8_t) (g) << 8) | (uint8_t) (b))
+
+enum {
+  HUI_BOLD      = 1 << 0,
+  HUI_DIM       = 1 << 1,
+  HUI_ITALIC    = 1 << 2,
+  HUI_UNDERLINE = 1 << 3,
+  HUI_BLINK     = 1 << 4,
+  HUI_REVERSE   = 1 << 5,
+  HUI_STRIKE    = 1 << 6,
+};
+
+// All zeros is the terminal default
+typedef struct {
+  uint32_t fg;
+  uint32_t bg;
+  uint32_t flags;
+} Hui_Attr;
+
+// Text from `start` on is drawn with `attr`, until the next run
+typedef struct {
+  uint32_t start;
+  Hui_Attr attr;
+} Hui_Attr_Run;
+
+int hui_attr_equal(Hui_Attr a, Hui_Attr b);
+// Apply the parameters of an SGR, what is between "\x1b[" and "m"
+void hui_sgr_apply(Hui_Attr* attr, const char* params, size_t size);
+// Size of the escape sequence `c` starts with, 0 if it isn't complete yet
+size_t hui_escape_size(const char* c, size_t size);
+// Copy the text without escapes, SGRs become runs. `runs` needs room for size / 3 + 1
+size_t hui_ansi_strip(const char* c, size_t size, Hui_Attr* attr, char* text, Hui_Attr_Run* runs, size_t* runs_count);
+
+// ----------------------------------------------------
+// UTF-8
+// ----------------------------------------------------
+#define HUI_REPLACEMENT 0xfffd
+// Cell to the right of a wide character, the terminal draws both with the left one
+#define HUI_WIDE_CONTINUATION 0xffffffffu
+
+// The code point `c` starts with, its size in bytes goes to `length`. An invalid byte is U+FFFD on its own
+uint32_t hui_utf8_decode(const char* c, size_t size, size_t* length);
+size_t hui_utf8_encode(uint32_t code_point, char* out);
+// Columns a code point takes: 0 for combining marks, 2 for East Asian wide ones and emoji.
+// Controls are drawn as a blank, 1
+int hui_code_point_width(uint32_t code_point);
+
 //Basic operations for everyday life
 Hui_Window hui_init();
 Hui_Window hui_create_window(uint64_t width, uint64_t height, uint64_t y, uint64_t x);
 void hui_put_text_at(char* c, size_t size, uint64_t y, uint64_t x);
+// Return how many columns were drawn
+size_t hui_put_text_attr_at(const char* c, size_t size, Hui_Attr attr, uint64_t y, uint64_t x);
 void hui_put_character_at(char c, uint64_t y, uint64_t x);
 void hui_put_text_at_window(Hui_Window window, char* c, size_t size, size_t y, size_t x);
+size_t hui_put_text_attr_at_window(Hui_Window window, const char* c, size_t size, Hui_Attr attr, size_t y, size_t x);
 void hui_put_character_at_window(Hui_Window window, char c, size_t y, size_t x);
 void hui_move_cursor_to(uint64_t y, uint64_t x);
 void hui_clear_window();
@@ -57,6 +116,15 @@ int64_t use_retain_mode();
 void start_drawing();
 void end_drawing();
 
+// What end_drawing wrote to the terminal, to measure how much a frame costs
+typedef struct {
+  size_t frames;
+  size_t last_frame_bytes;
+  size_t total_bytes;
+} Hui_Stats;
+
+Hui_Stats hui_stats();
+
 // ----------------------------------------------------
 // Hui_Input
 // ----------------------------------------------------
@@ -69,6 +137,7 @@ typedef struct {
   size_t capacity;
   size_t cursor;
   size_t focus;
+  char* prompt;
 } Hui_Input;
 
 //A dynamic array + a window,
@@ -122,17 +191,29 @@ Hui_Event hui_poll_event() {
   return hui_event_queue[hui_event_cursor_read_index++];
 }
 
+// 16 bytes, a vector compares a cell at a time
 typedef struct {
-  char* buffer;
-  uint8_t* foreground;
-  uint8_t* background;
+  uint32_t c;
+  Hui_Attr attr;
+} Hui_Cell;
+
+typedef struct {
+  Hui_Cell* cells;
+  // One per row, to spot rows that moved up or down since the last frame
+  uint64_t* row_hash;
+  // Rows that differ from the last frame, only those are walked cell by cell
+  uint8_t* row_changed;
   size_t capacity;
   size_t size;
 } Screen_Buffer;
 
+static void hui_hash_rows(Screen_Buffer* screen_buffer);
+
 static Screen_Buffer scr_buf[2] = {0};
 int curr_buff = 0;
 int64_t buffering = 0;
+// Set on resize, the next frame is drawn whole
+static volatile sig_atomic_t hui_full_repaint = 0;
 
 
 static void hui_resize(int i) {
@@ -141,17 +222,15 @@ static void hui_resize(int i) {
   ioctl(1, TIOCGWINSZ, &ws);
   terminal_width = ws.ws_col;
   terminal_height = ws.ws_row;
-  if (scr_buf[curr_buff].buffer) {
-    free(scr_buf[curr_buff].buffer);
-    free(scr_buf[curr_buff].foreground);
-    free(scr_buf[curr_buff].background);
-  } else if (scr_buf[!curr_buff].buffer) {
-    free(scr_buf[!curr_buff].buffer);
-    free(scr_buf[!curr_buff].foreground);
-    free(scr_buf[!curr_buff].background);
+  for (int i = 0; i < 2; i++) {
+    free(scr_buf[i].cells);
+    free(scr_buf[i].row_hash);
+    free(scr_buf[i].row_changed);
+    scr_buf[i].cells = NULL;
   }
 
   init_double_buffering();
+  hui_full_repaint = 1;
 
   push_event(RESIZE);
 }
@@ -249,66 +328,301 @@ void hui_move_cursor_to(uint64_t y, uint64_t x) {
   hui_print(buffer);
 }
 
-/*
- * We assume 0 based index
- */
-void hui_put_text_at(char* c, size_t size, uint64_t y, uint64_t x) {
-  if (buffering) {
-    Screen_Buffer* screen_buffer = &scr_buf[curr_buff];
-    int ansi_escape = 0;
-    size_t skip = 0;
-    //This info needs to be statefull, since the consumer might send a control in one line
-    //And the data in another, we would lose the "context" in this case
-    static uint8_t foreground = 39;
-    static uint8_t background = 49;
-    char* start_chunk = 0;
-    char* end_chunk = 0;
-
-    for (size_t i = 0; i < size; i++) {
-      if (c[i] == '\x1b' && i+1 < size && c[i+1] == '[') {
-        ansi_escape = 1;
-        skip=+2;
-        start_chunk = &c[i+2];
-        i++;
-        continue;
-      } else if (ansi_escape && c[i] == 'm') {
-        ansi_escape = 0;
-        skip++;
-        end_chunk = &c[i-1];
-
-        long escape_value = strtol(start_chunk, &end_chunk, 0);
-
-        //A problem happened when trying to process the escape code
-        if (escape_value == 0 && errno) {
-         assert(0 && "Error processing the escape code");
-        } else if (escape_value == 0) {
-          foreground = 39;
-          background = 49;
-        } else if (escape_value) {
-          if (escape_value > 29 && escape_value < 40) foreground = (uint8_t) escape_value;
-          if (escape_value > 39 && escape_value < 50) background = (uint8_t) escape_value;
-        }
+int hui_attr_equal(Hui_Attr a, Hui_Attr b) {
+  return a.fg == b.fg && a.bg == b.bg && a.flags == b.flags;
+}
 
-        continue;
-      }
-      //Screen modes, we don't really care
-      else if (ansi_escape && c[i] == 'h') {
-        ansi_escape = 0;
-        skip++;
-        end_chunk = &c[i-1];
-      } else if (ansi_escape) {
-        skip++;
-        continue;
-      }
-      size_t offset = y*terminal_width + x + i - skip;
+// Longer sequences are not escapes we know, only the ESC is dropped then
+#define HUI_ESCAPE_MAX 64
+
+size_t hui_escape_size(const char* c, size_t size) {
+  if (size < 2) return 0;
 
-      screen_buffer->buffer[offset]      = c[i];
-      screen_buffer->foreground[offset]  = foreground;
-      screen_buffer->background[offset]  = background;
+  if (c[1] == '[') {
+    // CSI: parameters and intermediates, then a final byte in @..~
+    for (size_t i = 2; i < size && i < HUI_ESCAPE_MAX; i++) {
+      if (c[i] >= 0x40 && c[i] <= 0x7e) return i + 1;
+      // A broken sequence, don't let it eat the newline
+      if ((unsigned char) c[i] < 0x20) return i;
+    }
+  } else if (c[1] == ']') {
+    // OSC: ends with BEL or ST
+    for (size_t i = 2; i < size && i < HUI_ESCAPE_MAX; i++) {
+      if (c[i] == '\a') return i + 1;
+      if (c[i] == '\x1b' && i + 1 < size) return c[i + 1] == '\\' ? i + 2 : i;
+      if (c[i] == '\n') return i;
     }
   } else {
+    return 2;
+  }
+
+  return size < HUI_ESCAPE_MAX ? 0 : 1;
+}
+
+static uint32_t hui_sgr_color(const long* params, size_t count, size_t* i) {
+  // 38;5;n and 38;2;r;g;b
+  if (*i + 2 < count && params[*i + 1] == 5) {
+    *i += 2;
+    return HUI_COLOR_INDEXED(params[*i]);
+  }
+  if (*i + 4 < count && params[*i + 1] == 2) {
+    *i += 4;
+    return HUI_COLOR_RGB(params[*i - 2], params[*i - 1], params[*i]);
+  }
+  // Not something we understand, skip the rest
+  *i = count;
+  return HUI_COLOR_DEFAULT;
+}
+
+void hui_sgr_apply(Hui_Attr* attr, const char* params, size_t size) {
+  long values[32];
+  size_t count = 0;
+  long value = 0;
+
+  // ':' separates the same way in 38:2:r:g:b
+  for (size_t i = 0; i <= size && count < sizeof(values) / sizeof(values[0]); i++) {
+    if (i == size || params[i] == ';' || params[i] == ':') {
+      values[count++] = value;
+      value = 0;
+    } else if (params[i] >= '0' && params[i] <= '9') {
+      value = value < 100000 ? value * 10 + (params[i] - '0') : value;
+    } else {
+      // Private sequences like "\x1b[?25m" aren't colours
+      return;
+    }
+  }
+
+  for (size_t i = 0; i < count; i++) {
+    long code = values[i];
+    if (code == 0) *attr = (Hui_Attr) {0};
+    else if (code == 1) attr->flags |= HUI_BOLD;
+    else if (code == 2) attr->flags |= HUI_DIM;
+    else if (code == 3) attr->flags |= HUI_ITALIC;
+    else if (code == 4) attr->flags |= HUI_UNDERLINE;
+    else if (code == 5) attr->flags |= HUI_BLINK;
+    else if (code == 7) attr->flags |= HUI_REVERSE;
+    else if (code == 9) attr->flags |= HUI_STRIKE;
+    else if (code == 22) attr->flags &= ~(HUI_BOLD | HUI_DIM);
+    else if (code == 23) attr->flags &= ~HUI_ITALIC;
+    else if (code == 24) attr->flags &= ~HUI_UNDERLINE;
+    else if (code == 25) attr->flags &= ~HUI_BLINK;
+    else if (code == 27) attr->flags &= ~HUI_REVERSE;
+    else if (code == 29) attr->flags &= ~HUI_STRIKE;
+    else if (code >= 30 && code <= 37) attr->fg = HUI_COLOR_INDEXED(code - 30);
+    else if (code == 38) attr->fg = hui_sgr_color(values, count, &i);
+    else if (code == 39) attr->fg = HUI_COLOR_DEFAULT;
+    else if (code >= 40 && code <= 47) attr->bg = HUI_COLOR_INDEXED(code - 40);
+    else if (code == 48) attr->bg = hui_sgr_color(values, count, &i);
+    else if (code == 49) attr->bg = HUI_COLOR_DEFAULT;
+    else if (code >= 90 && code <= 97) attr->fg = HUI_COLOR_INDEXED(code - 90 + 8);
+    else if (code >= 100 && code <= 107) attr->bg = HUI_COLOR_INDEXED(code - 100 + 8);
+  }
+}
+
+size_t hui_ansi_strip(const char* c, size_t size, Hui_Attr* attr, char* text, Hui_Attr_Run* runs, size_t* runs_count) {
+  size_t count = 0;
+  *runs_count = 0;
+
+  // What the previous line left set carries over
+  if (!hui_attr_equal(*attr, (Hui_Attr) {0})) runs[(*runs_count)++] = (Hui_Attr_Run) { .start = 0, .attr = *attr };
+
+  for (size_t i = 0; i < size;) {
+    const char* escape = memchr(c + i, '\x1b', size - i);
+    size_t plain = escape ? (size_t) (escape - c) - i : size - i;
+    memcpy(text + count, c + i, plain);
+    count += plain;
+    i += plain;
+    if (i == size) break;
+
+    // A sequence cut by the end of the line is dropped whole
+    size_t n = hui_escape_size(c + i, size - i);
+    if (!n) n = size - i;
+
+    if (n >= 3 && c[i + 1] == '[' && c[i + n - 1] == 'm') {
+      hui_sgr_apply(attr, c + i + 2, n - 3);
+      if (*runs_count && runs[*runs_count - 1].start == count) (*runs_count)--;
+      runs[(*runs_count)++] = (Hui_Attr_Run) { .start = (uint32_t) count, .attr = *attr };
+    }
+    i += n;
+  }
+
+  return count;
+}
+
+uint32_t hui_utf8_decode(const char* c, size_t size, size_t* length) {
+  const uint8_t* u = (const uint8_t*) c;
+  *length = 1;
+  if (u[0] < 0x80) return u[0];
+
+  size_t n;
+  uint32_t code_point, min;
+  if ((u[0] & 0xe0) == 0xc0) { n = 2; code_point = u[0] & 0x1f; min = 0x80; }
+  else if ((u[0] & 0xf0) == 0xe0) { n = 3; code_point = u[0] & 0x0f; min = 0x800; }
+  else if ((u[0] & 0xf8) == 0xf0) { n = 4; code_point = u[0] & 0x07; min = 0x10000; }
+  else return HUI_REPLACEMENT;
+
+  if (size < n) return HUI_REPLACEMENT;
+  for (size_t i = 1; i < n; i++) {
+    if ((u[i] & 0xc0) != 0x80) return HUI_REPLACEMENT;
+    code_point = (code_point << 6) | (u[i] & 0x3f);
+  }
+
+  // Overlong forms, surrogates and past the last plane
+  if (code_point < min || (code_point >= 0xd800 && code_point <= 0xdfff) || code_point > 0x10ffff) return HUI_REPLACEMENT;
+  *length = n;
+  return code_point;
+}
+
+size_t hui_utf8_encode(uint32_t code_point, char* out) {
+  if (code_point < 0x80) {
+    out[0] = (char) code_point;
+    return 1;
+  }
+  if (code_point < 0x800) {
+    out[0] = (char) (0xc0 | (code_point >> 6));
+    out[1] = (char) (0x80 | (code_point & 0x3f));
+    return 2;
+  }
+  if (code_point < 0x10000) {
+    out[0] = (char) (0xe0 | (code_point >> 12));
+    out[1] = (char) (0x80 | ((code_point >> 6) & 0x3f));
+    out[2] = (char) (0x80 | (code_point & 0x3f));
+    return 3;
+  }
+  out[0] = (char) (0xf0 | (code_point >> 18));
+  out[1] = (char) (0x80 | ((code_point >> 12) & 0x3f));
+  out[2] = (char) (0x80 | ((code_point >> 6) & 0x3f));
+  out[3] = (char) (0x80 | (code_point & 0x3f));
+  return 4;
+}
+
+typedef struct {
+  uint32_t first;
+  uint32_t last;
+} Hui_Range;
+
+// Combining marks, zero width spaces, joiners, variation selectors and emoji modifiers
+static const Hui_Range hui_zero_width[] = {
+  {0x0300, 0x036f}, {0x0483, 0x0489}, {0x0591, 0x05bd}, {0x05bf, 0x05bf}, {0x05c1, 0x05c2},
+  {0x05c4, 0x05c5}, {0x05c7, 0x05c7}, {0x0610, 0x061a}, {0x064b, 0x065f}, {0x0670, 0x0670},
+  {0x06d6, 0x06dc}, {0x06df, 0x06e4}, {0x06e7, 0x06e8}, {0x06ea, 0x06ed}, {0x0900, 0x0902},
+  {0x093a, 0x093a}, {0x093c, 0x093c}, {0x0941, 0x0948}, {0x094d, 0x094d}, {0x0951, 0x0957},
+  {0x0e31, 0x0e31}, {0x0e34, 0x0e3a}, {0x0e47, 0x0e4e}, {0x1ab0, 0x1aff}, {0x1dc0, 0x1dff},
+  {0x200b, 0x200f}, {0x202a, 0x202e}, {0x2060, 0x2064}, {0x20d0, 0x20ff}, {0xfe00, 0xfe0f},
+  {0xfe20, 0xfe2f}, {0xfeff, 0xfeff}, {0x1f3fb, 0x1f3ff}, {0xe0000, 0xe0fff},
+};
+
+// East Asian wide and fullwidth, and the emoji terminals draw in two columns
+static const Hui_Range hui_wide[] = {
+  {0x1100, 0x115f}, {0x231a, 0x231b}, {0x2329, 0x232a}, {0x23e9, 0x23ec}, {0x23f0, 0x23f0},
+  {0x23f3, 0x23f3}, {0x25fd, 0x25fe}, {0x2614, 0x2615}, {0x2648, 0x2653}, {0x267f, 0x267f},
+  {0x2693, 0x2693}, {0x26a1, 0x26a1}, {0x26aa, 0x26ab}, {0x26bd, 0x26be}, {0x26c4, 0x26c5},
+  {0x26ce, 0x26ce}, {0x26d4, 0x26d4}, {0x26ea, 0x26ea}, {0x26f2, 0x26f3}, {0x26f5, 0x26f5},
+  {0x26fa, 0x26fa}, {0x26fd, 0x26fd}, {0x2705, 0x2705}, {0x270a, 0x270b}, {0x2728, 0x2728},
+  {0x274c, 0x274c}, {0x274e, 0x274e}, {0x2753, 0x2755}, {0x2757, 0x2757}, {0x2795, 0x2797},
+  {0x27b0, 0x27b0}, {0x27bf, 0x27bf}, {0x2b1b, 0x2b1c}, {0x2b50, 0x2b50}, {0x2b55, 0x2b55},
+  {0x2e80, 0x303e}, {0x3041, 0x33ff}, {0x3400, 0x4dbf}, {0x4e00, 0x9fff}, {0xa000, 0xa4cf},
+  {0xa960, 0xa97f}, {0xac00, 0xd7a3}, {0xf900, 0xfaff}, {0xfe10, 0xfe19}, {0xfe30, 0xfe6f},
+  {0xff00, 0xff60}, {0xffe0, 0xffe6}, {0x16fe0, 0x16fe4}, {0x17000, 0x18cff}, {0x1b000, 0x1b2ff},
+  {0x1f004, 0x1f004}, {0x1f0cf, 0x1f0cf}, {0x1f18e, 0x1f18e}, {0x1f191, 0x1f19a}, {0x1f200, 0x1f251},
+  {0x1f300, 0x1f320}, {0x1f32d, 0x1f335}, {0x1f337, 0x1f37c}, {0x1f37e, 0x1f393}, {0x1f3a0, 0x1f3ca},
+  {0x1f3cf, 0x1f3d3}, {0x1f3e0, 0x1f3f0}, {0x1f3f4, 0x1f3f4}, {0x1f3f8, 0x1f43e}, {0x1f440, 0x1f440},
+  {0x1f442, 0x1f4fc}, {0x1f4ff, 0x1f53d}, {0x1f54b, 0x1f54e}, {0x1f550, 0x1f567}, {0x1f57a, 0x1f57a},
+  {0x1f595, 0x1f596}, {0x1f5a4, 0x1f5a4}, {0x1f5fb, 0x1f64f}, {0x1f680, 0x1f6c5}, {0x1f6cc, 0x1f6cc},
+  {0x1f6d0, 0x1f6d2}, {0x1f6d5, 0x1f6d7}, {0x1f6eb, 0x1f6ec}, {0x1f6f4, 0x1f6fc}, {0x1f7e0, 0x1f7eb},
+  {0x1f90c, 0x1f93a}, {0x1f93c, 0x1f945}, {0x1f947, 0x1f9ff}, {0x1fa70, 0x1faff}, {0x20000, 0x2fffd},
+  {0x30000, 0x3fffd},
+};
+
+static int hui_in_ranges(const Hui_Range* ranges, size_t count, uint32_t code_point) {
+  size_t lo = 0, hi = count;
+  while (lo < hi) {
+    size_t mid = lo + (hi - lo) / 2;
+    if (code_point < ranges[mid].first) hi = mid;
+    else if (code_point > ranges[mid].last) lo = mid + 1;
+    else return 1;
+  }
+  return 0;
+}
+
+int hui_code_point_width(uint32_t code_point) {
+  if (code_point < 0x300) return 1;
+  if (hui_in_ranges(hui_zero_width, sizeof(hui_zero_width) / sizeof(hui_zero_width[0]), code_point)) return 0;
+  if (code_point < 0x1100) return 1;
+  return hui_in_ranges(hui_wide, sizeof(hui_wide) / sizeof(hui_wide[0]), code_point) ? 2 : 1;
+}
+
+/*
+ * Draw up to column `end_x`, return how many columns were drawn
+ */
+static size_t hui_put_text_clipped(const char* c, size_t size, Hui_Attr attr, uint64_t y, uint64_t x, uint64_t end_x) {
+  if (end_x > terminal_width) end_x = terminal_width;
+  if (y >= terminal_height || x >= end_x) return 0;
+
+  Screen_Buffer* screen_buffer = &scr_buf[curr_buff];
+  Hui_Cell* row = screen_buffer->cells + y*terminal_width;
+  size_t col = x;
+
+  for (size_t i = 0; i < size && col < end_x;) {
+    size_t length;
+    uint32_t code_point = hui_utf8_decode(c + i, size - i, &length);
+    i += length;
+
+    //Tabs, carriage returns and the other controls would move the real cursor around, draw them as blanks
+    if (code_point < 0x20 || (code_point >= 0x7f && code_point < 0xa0)) code_point = ' ';
+
+    int width = hui_code_point_width(code_point);
+    if (width == 0) continue;
+    // Half of it wouldn't fit
+    if (width == 2 && col + 1 >= end_x) {
+      code_point = ' ';
+      width = 1;
+    }
+
+    row[col] = (Hui_Cell) { .c = code_point, .attr = attr };
+    if (width == 2) row[col + 1] = (Hui_Cell) { .c = HUI_WIDE_CONTINUATION, .attr = attr };
+    col += width;
+  }
+
+  return col - x;
+}
+
+/*
+ * UTF-8 text without escapes, in one set of attributes. We assume 0 based index
+ */
+size_t hui_put_text_attr_at(const char* c, size_t size, Hui_Attr attr, uint64_t y, uint64_t x) {
+  if (!buffering) {
     hui_move_cursor_to(y,x);
     write(output_fd, c, size);
+    return size;
+  }
+
+  return hui_put_text_clipped(c, size, attr, y, x, terminal_width);
+}
+
+/*
+ * Text that may have escapes in it, they only apply to this text. We assume 0 based index
+ */
+void hui_put_text_at(char* c, size_t size, uint64_t y, uint64_t x) {
+  if (!buffering) {
+    hui_move_cursor_to(y,x);
+    write(output_fd, c, size);
+    return;
+  }
+
+  Hui_Attr attr = {0};
+  size_t i = 0;
+  while (i < size) {
+    const char* escape = memchr(c + i, '\x1b', size - i);
+    size_t plain = escape ? (size_t) (escape - c) - i : size - i;
+    x += hui_put_text_attr_at(c + i, plain, attr, y, x);
+    i += plain;
+    if (i == size) break;
+
+    size_t n = hui_escape_size(c + i, size - i);
+    if (!n) n = size - i;
+    if (n >= 3 && c[i + 1] == '[' && c[i + n - 1] == 'm') hui_sgr_apply(&attr, c + i + 2, n - 3);
+    i += n;
   }
 }
 
@@ -318,7 +632,7 @@ void hui_put_text_at(char* c, size_t size, uint64_t y, uint64_t x) {
 void hui_put_character_at(char c, uint64_t y, uint64_t x) {
   if (buffering) {
     Screen_Buffer* screen_buffer = &scr_buf[curr_buff];
-    screen_buffer->buffer[y*terminal_width + x]  = c;
+    screen_buffer->cells[y*terminal_width + x].c = (uint8_t) c;
   } else {
     hui_move_cursor_to(y,x);
     write(output_fd, &c, 1);
@@ -337,6 +651,15 @@ void hui_put_text_at_window(Hui_Window window, char* c, size_t size, size_t y, s
   }
 }
 
+/*
+ * Clipped to the window. We assume 0 based index
+ */
+size_t hui_put_text_attr_at_window(Hui_Window window, const char* c, size_t size, Hui_Attr attr, size_t y, size_t x) {
+  if (y >= window.height || x >= window.width) return 0;
+  if (!buffering) return hui_put_text_attr_at(c, size, attr, window.y + y, window.x + x);
+  return hui_put_text_clipped(c, size, attr, window.y + y, window.x + x, window.x + window.width);
+}
+
 /*
  * We assume 0 based index
  */
@@ -390,6 +713,7 @@ Hui_Input hui_create_input_window(uint64_t width, uint64_t height, uint64_t y, u
     .capacity = 0,
     .cursor = 0,
     .focus = 0,
+    .prompt = "/",
   };
 
   return input;
@@ -428,44 +752,55 @@ int64_t hui_input_pop_char(Hui_Input* input) {
 }
 
 void hui_draw_input_window(Hui_Input input) {
-  Hui_Window win = *((Hui_Window *) &input);
+  Hui_Window win = { .width = input.width, .height = input.height, .x = input.x, .y = input.y };
   if (input.focus) {
     char buffer[256] = {0};
     sprintf(buffer, "\x1b[%"PRIu64";%"PRIu64"H", input.y, input.x);
     hui_print(buffer);
     hui_print("\x1b[?25h");
-    hui_put_text_at_window(win, "/", 1, 0, 0);
+    hui_put_text_at_window(win, input.prompt, strlen(input.prompt), 0, 0);
   } else {
     char buffer[256] = {0};
     hui_print(buffer);
     hui_print("\x1b[?25l");
   }
   if (input.cursor > 0) {
-    hui_put_text_at_window(win, input.buffer, input.cursor, 0, 1);
+    hui_put_text_at_window(win, input.buffer, input.cursor, 0, strlen(input.prompt));
+  }
+}
+
+/*
+ * Fill with blanks in the default attributes
+ */
+static void hui_screen_buffer_clear(Screen_Buffer* screen_buffer) {
+  size_t screen_size = terminal_width * terminal_height;
+  if (!screen_size) return;
+
+  screen_buffer->cells[0] = (Hui_Cell) { .c = ' ' };
+  for (size_t filled = 1; filled < screen_size; filled *= 2) {
+    size_t n = filled < screen_size - filled ? filled : screen_size - filled;
+    memcpy(screen_buffer->cells + filled, screen_buffer->cells, n * sizeof(Hui_Cell));
   }
 }
 
+static void hui_screen_buffer_alloc(Screen_Buffer* screen_buffer) {
+  size_t screen_size = terminal_width * terminal_height;
+  screen_buffer->size = screen_size;
+  screen_buffer->cells = malloc(screen_size * sizeof(Hui_Cell));
+  screen_buffer->row_hash = malloc(terminal_height * sizeof(uint64_t));
+  screen_buffer->row_changed = malloc(terminal_height * sizeof(uint8_t));
+}
+
 static void init_double_buffering()
 {
   if (buffering) {
-    size_t screen_size = terminal_width * terminal_height;
-    scr_buf[curr_buff].size = screen_size;
-    scr_buf[curr_buff].buffer = malloc(screen_size * sizeof(char));
-    scr_buf[curr_buff].foreground = malloc(screen_size * sizeof(uint8_t));
-    scr_buf[curr_buff].background = malloc(screen_size * sizeof(uint8_t));
+    hui_screen_buffer_alloc(&scr_buf[curr_buff]);
+    hui_screen_buffer_clear(&scr_buf[curr_buff]);
+    hui_hash_rows(&scr_buf[curr_buff]);
 
-    memset(scr_buf[curr_buff].buffer, ' ', screen_size * sizeof(char));
-    memset(scr_buf[curr_buff].foreground, 39, screen_size * sizeof(uint8_t));
-    memset(scr_buf[curr_buff].background, 49, screen_size * sizeof(uint8_t));
-
-    scr_buf[!curr_buff].size = screen_size;
-    scr_buf[!curr_buff].buffer = malloc(screen_size * sizeof(char));
-    scr_buf[!curr_buff].foreground = malloc(screen_size * sizeof(uint8_t));
-    scr_buf[!curr_buff].background = malloc(screen_size * sizeof(uint8_t));
-
-    memset(scr_buf[!curr_buff].buffer, ' ', screen_size * sizeof(char));
-    memset(scr_buf[!curr_buff].foreground, 39, screen_size * sizeof(uint8_t));
-    memset(scr_buf[!curr_buff].background, 49, screen_size * sizeof(uint8_t));
+    hui_screen_buffer_alloc(&scr_buf[!curr_buff]);
+    hui_screen_buffer_clear(&scr_buf[!curr_buff]);
+    hui_hash_rows(&scr_buf[!curr_buff]);
   }
 }
 
@@ -481,17 +816,9 @@ void start_drawing() {
   if (!buffering) return;
 
   Screen_Buffer* screen_buffer = &scr_buf[curr_buff];
-  size_t screen_size = terminal_width * terminal_height;
-  screen_buffer->size = screen_size;
-  if (!screen_buffer->buffer) {
-    screen_buffer->buffer = malloc(screen_size * sizeof(char));
-    screen_buffer->foreground = malloc(screen_size * sizeof(uint8_t));
-    screen_buffer->background = malloc(screen_size * sizeof(uint8_t));
-  }
+  if (!screen_buffer->cells) hui_screen_buffer_alloc(screen_buffer);
 
-  memset(screen_buffer->buffer, ' ', screen_size * sizeof(char));
-  memset(screen_buffer->foreground, 39, screen_size * sizeof(uint8_t));
-  memset(screen_buffer->background, 49, screen_size * sizeof(uint8_t));
+  hui_screen_buffer_clear(screen_buffer);
 }
 
 static struct {
@@ -500,6 +827,247 @@ static struct {
   size_t size;
 } patches_buffer = {0};
 
+// Where the terminal cursor is and which attributes it writes with, -1 when we don't know
+static struct {
+  int64_t row;
+  int64_t col;
+  Hui_Attr attr;
+  int attr_known;
+} hui_pen;
+
+static Hui_Stats hui_frame_stats = {0};
+
+// Unchanged cells this close are rewritten instead of jumped over, a cursor move costs more
+#define HUI_GAP_REWRITE 4
+
+// A shift must save at least this many row repaints to be worth the escapes
+#define HUI_SCROLL_MIN_GAIN 2
+
+// ----------------------------------------------------
+// Row compare, most rows of a frame are the same as in the last one
+// ----------------------------------------------------
+typedef int (*Hui_Cells_Equal)(const Hui_Cell* a, const Hui_Cell* b, size_t count);
+
+static int hui_cells_equal_scalar(const Hui_Cell* a, const Hui_Cell* b, size_t count) {
+  return memcmp(a, b, count * sizeof(Hui_Cell)) == 0;
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+__attribute__((target("sse2")))
+static int hui_cells_equal_sse2(const Hui_Cell* a, const Hui_Cell* b, size_t count) {
+  const __m128i zero = _mm_setzero_si128();
+  size_t i = 0;
+
+  // Two cells per iteration, the differences are or-ed so there is one branch
+  for (; i + 2 <= count; i += 2) {
+    __m128i diff = _mm_or_si128(_mm_xor_si128(_mm_loadu_si128((const __m128i*) (a + i)), _mm_loadu_si128((const __m128i*) (b + i))),
+                                _mm_xor_si128(_mm_loadu_si128((const __m128i*) (a + i + 1)), _mm_loadu_si128((const __m128i*) (b + i + 1))));
+    if (_mm_movemask_epi8(_mm_cmpeq_epi8(diff, zero)) != 0xffff) return 0;
+  }
+
+  return hui_cells_equal_scalar(a + i, b + i, count - i);
+}
+
+__attribute__((target("avx2")))
+static int hui_cells_equal_avx2(const Hui_Cell* a, const Hui_Cell* b, size_t count) {
+  size_t i = 0;
+
+  for (; i + 4 <= count; i += 4) {
+    __m256i diff = _mm256_or_si256(_mm256_xor_si256(_mm256_loadu_si256((const __m256i*) (a + i)), _mm256_loadu_si256((const __m256i*) (b + i))),
+                                   _mm256_xor_si256(_mm256_loadu_si256((const __m256i*) (a + i + 2)), _mm256_loadu_si256((const __m256i*) (b + i + 2))));
+    if (!_mm256_testz_si256(diff, diff)) return 0;
+  }
+
+  return hui_cells_equal_sse2(a + i, b + i, count - i);
+}
+#endif
+
+/*
+ * Pick the widest kernel the cpu supports, only done once
+ */
+static int hui_cells_equal(const Hui_Cell* a, const Hui_Cell* b, size_t count) {
+  static Hui_Cells_Equal kernel = NULL;
+
+  if (!kernel) {
+    kernel = hui_cells_equal_scalar;
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("sse2")) kernel = hui_cells_equal_sse2;
+    if (__builtin_cpu_supports("avx2")) kernel = hui_cells_equal_avx2;
+#endif
+  }
+
+  return kernel(a, b, count);
+}
+
+static int hui_row_equal(Screen_Buffer* a, Screen_Buffer* b, size_t row) {
+  return hui_cells_equal(a->cells + row * terminal_width, b->cells + row * terminal_width, terminal_width);
+}
+
+static uint64_t hui_hash_row(Screen_Buffer* screen_buffer, size_t row) {
+  // FNV-1a, a collision only costs a few bytes, the cell diff still fixes the row
+  uint64_t hash = 14695981039346656037ULL;
+  size_t offset = row * terminal_width;
+  for (size_t col = 0; col < terminal_width; col++) {
+    Hui_Cell cell = screen_buffer->cells[offset + col];
+    hash = (hash ^ cell.c) * 1099511628211ULL;
+    hash = (hash ^ cell.attr.fg) * 1099511628211ULL;
+    hash = (hash ^ cell.attr.bg) * 1099511628211ULL;
+    hash = (hash ^ cell.attr.flags) * 1099511628211ULL;
+  }
+  return hash;
+}
+
+static void hui_hash_rows(Screen_Buffer* screen_buffer) {
+  for (size_t row = 0; row < terminal_height; row++) {
+    screen_buffer->row_hash[row] = hui_hash_row(screen_buffer, row);
+  }
+}
+
+typedef struct {
+  size_t top;
+  size_t bottom;
+  // > 0 the content moved up, < 0 down
+  int64_t shift;
+} Hui_Scroll;
+
+/*
+ * Look for a block of rows that moved up or down between the frames, like a followed view getting a new line.
+ * Return 0 if none would save more than it costs
+ */
+static int hui_find_scroll(Screen_Buffer* screen_buffer, Screen_Buffer* back_buffer, Hui_Scroll* scroll) {
+  uint64_t* now = screen_buffer->row_hash;
+  uint64_t* before = back_buffer->row_hash;
+  int64_t best_gain = HUI_SCROLL_MIN_GAIN - 1;
+
+  for (size_t k = 1; k < terminal_height; k++) {
+    for (int up = 1; up >= 0; up--) {
+      // Rows that landed where they are from k rows below, or above going down
+      size_t run = 0;
+      int64_t gain = 0;
+      for (size_t r = up ? 0 : k; r < (up ? terminal_height - k : terminal_height); r++) {
+        size_t from = up ? r + k : r - k;
+        if (now[r] == before[from]) {
+          run++;
+          // Rows that didn't change in place are free anyway
+          if (now[r] != before[r]) gain++;
+        } else {
+          run = 0;
+          gain = 0;
+        }
+
+        // The k rows it exposes have to be painted
+        if (run && gain - (int64_t) k > best_gain) {
+          best_gain = gain - k;
+          scroll->top = up ? r + 1 - run : r + 1 - run - k;
+          scroll->bottom = up ? r + k : r;
+          scroll->shift = up ? (int64_t) k : -(int64_t) k;
+        }
+      }
+    }
+  }
+
+  return best_gain >= HUI_SCROLL_MIN_GAIN;
+}
+
+/*
+ * Do to the back buffer what the terminal did to the screen, the cell diff then only sees the new rows
+ */
+static void hui_scroll_back_buffer(Screen_Buffer* back_buffer, Hui_Scroll scroll) {
+  size_t k = scroll.shift > 0 ? scroll.shift : -scroll.shift;
+  size_t rows = scroll.bottom - scroll.top + 1 - k;
+  size_t to = scroll.shift > 0 ? scroll.top : scroll.top + k;
+  size_t from = scroll.shift > 0 ? scroll.top + k : scroll.top;
+  size_t exposed = scroll.shift > 0 ? scroll.bottom + 1 - k : scroll.top;
+
+  memmove(back_buffer->cells + to * terminal_width, back_buffer->cells + from * terminal_width, rows * terminal_width * sizeof(Hui_Cell));
+  memmove(back_buffer->row_hash + to, back_buffer->row_hash + from, rows * sizeof(uint64_t));
+
+  for (size_t row = exposed; row < exposed + k; row++) {
+    for (size_t col = 0; col < terminal_width; col++) back_buffer->cells[row * terminal_width + col] = (Hui_Cell) { .c = ' ' };
+    back_buffer->row_hash[row] = hui_hash_row(back_buffer, row);
+  }
+}
+
+Hui_Stats hui_stats() {
+  return hui_frame_stats;
+}
+
+static void hui_patch(const char* content, size_t size) {
+  hui_append_to(&patches_buffer.content, &patches_buffer.capacity, &patches_buffer.size, content, size);
+}
+
+static int hui_format_color(char* buffer, uint32_t color, int base) {
+  uint32_t value = color & 0xffffff;
+  if ((color >> 24) == 1 && value < 8) return sprintf(buffer, ";%d", base + (int) value);
+  if ((color >> 24) == 1 && value < 16) return sprintf(buffer, ";%d", base + 60 + (int) value - 8);
+  if ((color >> 24) == 1) return sprintf(buffer, ";%d;5;%d", base + 8, (int) value);
+  if ((color >> 24) == 2) return sprintf(buffer, ";%d;2;%d;%d;%d", base + 8, (int) (value >> 16), (int) ((value >> 8) & 0xff), (int) (value & 0xff));
+  return 0;
+}
+
+/*
+ * The SGR that sets `attr` from any state, it starts with a reset. `buffer` needs 64 bytes
+ */
+static int hui_format_sgr(char* buffer, Hui_Attr attr) {
+  static const int codes[] = { 1, 2, 3, 4, 5, 7, 9 };
+  int n = sprintf(buffer, "\x1b[0");
+  for (size_t i = 0; i < sizeof(codes) / sizeof(codes[0]); i++) {
+    if (attr.flags & (1u << i)) n += sprintf(buffer + n, ";%d", codes[i]);
+  }
+  n += hui_format_color(buffer + n, attr.fg, 30);
+  n += hui_format_color(buffer + n, attr.bg, 40);
+  buffer[n++] = 'm';
+  return n;
+}
+
+/*
+ * Write one cell, moving the cursor and changing the colours only when needed
+ */
+static void hui_patch_cell(Screen_Buffer* screen_buffer, size_t row, size_t col) {
+  size_t offset = row * terminal_width + col;
+  uint32_t code_point = screen_buffer->cells[offset].c;
+  // Drawn together with the wide character on its left
+  if (code_point == HUI_WIDE_CONTINUATION) return;
+
+  Hui_Attr attr = screen_buffer->cells[offset].attr;
+  char internal_buffer[64];
+  int n;
+
+  if (hui_pen.row != (int64_t) row || hui_pen.col != (int64_t) col) {
+    n = sprintf(internal_buffer, "\x1b[%zu;%zuH", row + 1, col + 1);
+    hui_patch(internal_buffer, n);
+  }
+
+  if (!hui_pen.attr_known || !hui_attr_equal(hui_pen.attr, attr)) {
+    n = hui_format_sgr(internal_buffer, attr);
+    hui_patch(internal_buffer, n);
+    hui_pen.attr = attr;
+    hui_pen.attr_known = 1;
+  }
+
+  char c[4];
+  hui_patch(c, hui_utf8_encode(code_point, c));
+  size_t next = col + 1;
+  if (next < terminal_width && screen_buffer->cells[offset + 1].c == HUI_WIDE_CONTINUATION) next++;
+  hui_pen.row = row;
+  // Writing the last column leaves the cursor waiting to wrap, terminals disagree on where that is
+  hui_pen.col = next < terminal_width ? (int64_t) next : -1;
+}
+
+/*
+ * Return 1 if the cells between the cursor and `col` can be written again with the current colours
+ */
+static int hui_gap_is_cheap(Screen_Buffer* screen_buffer, size_t row, size_t col) {
+  if (hui_pen.row != (int64_t) row || hui_pen.col < 0 || (size_t) hui_pen.col >= col || col - hui_pen.col > HUI_GAP_REWRITE) return 0;
+
+  for (size_t i = hui_pen.col; i < col; i++) {
+    size_t offset = row * terminal_width + i;
+    if (!hui_pen.attr_known || !hui_attr_equal(screen_buffer->cells[offset].attr, hui_pen.attr)) return 0;
+  }
+  return 1;
+}
+
 void end_drawing() {
   if (!buffering) return;
   //Latest display, the one about to be draw
@@ -509,32 +1077,83 @@ void end_drawing() {
   Screen_Buffer back_buffer = scr_buf[!curr_buff];
   patches_buffer.size = 0;
 
-  if (scr_buf[curr_buff].size != scr_buf[!curr_buff].size) {
-    write(output_fd, screen_buffer->buffer, screen_buffer->size);
-  } else {
-    for (size_t row = 0; row < terminal_height; row++) {
-      for (size_t col = 0; col < terminal_width; col++) {
-        size_t offset = row * terminal_width + col;
-        char c1 = screen_buffer->buffer[offset];
-        char c2 = back_buffer.buffer[offset];
-
-        uint8_t fg1 = screen_buffer->foreground[offset];
-        uint8_t fg2 = back_buffer.foreground[offset];
-
-        uint8_t bg1 = screen_buffer->background[offset];
-        uint8_t bg2 = back_buffer.background[offset];
-
-        if (c2 != c1 || fg1 != fg2 || bg1 != bg2) {
-          char internal_buffer[50];
-          int n = sprintf(internal_buffer, "\x1b[%"PRIu64";%"PRIu64"H\x1b[%d;%dm%c", row+1, col+1, fg1, bg1, c1);
-          hui_append_to(&patches_buffer.content, &patches_buffer.capacity, &patches_buffer.size, internal_buffer, n);
-        }
+  // Anything could have been printed since the last frame
+  hui_pen.row = -1;
+  hui_pen.col = -1;
+  hui_pen.attr_known = 0;
+
+  // After a resize what the terminal shows has nothing to do with the back buffer
+  int full = hui_full_repaint || scr_buf[curr_buff].size != scr_buf[!curr_buff].size;
+  hui_full_repaint = 0;
+
+  // Rows that didn't change keep their hash, an idle frame is only this compare
+  size_t changed = 0;
+  for (size_t row = 0; row < terminal_height; row++) {
+    screen_buffer->row_changed[row] = full || !hui_row_equal(screen_buffer, &back_buffer, row);
+    screen_buffer->row_hash[row] = screen_buffer->row_changed[row] ? hui_hash_row(screen_buffer, row) : back_buffer.row_hash[row];
+    changed += screen_buffer->row_changed[row];
+  }
+
+  // Let the terminal move rows that only shifted, the blank ones it exposes are filled with the default colours
+  Hui_Scroll scroll;
+  if (!full && changed && hui_find_scroll(screen_buffer, &back_buffer, &scroll)) {
+    char internal_buffer[80];
+    int whole = scroll.top == 0 && scroll.bottom + 1 == terminal_height;
+    size_t k = scroll.shift > 0 ? scroll.shift : -scroll.shift;
+    int n = 0;
+
+    n += sprintf(internal_buffer + n, "\x1b[0m");
+    if (!whole) n += sprintf(internal_buffer + n, "\x1b[%zu;%zur", scroll.top + 1, scroll.bottom + 1);
+    n += sprintf(internal_buffer + n, "\x1b[%zu%c", k, scroll.shift > 0 ? 'S' : 'T');
+    if (!whole) n += sprintf(internal_buffer + n, "\x1b[r");
+    hui_patch(internal_buffer, n);
+
+    hui_pen.attr = (Hui_Attr) {0};
+    hui_pen.attr_known = 1;
+    // Setting the region homes the cursor
+    hui_pen.row = whole ? -1 : 0;
+    hui_pen.col = whole ? -1 : 0;
+    hui_scroll_back_buffer(&back_buffer, scroll);
+
+    for (size_t row = scroll.top; row <= scroll.bottom; row++) {
+      screen_buffer->row_changed[row] = !hui_row_equal(screen_buffer, &back_buffer, row);
+    }
+  }
+
+  // Changed cells next to each other become one run: a single cursor move, colours only when they change
+  for (size_t row = 0; row < terminal_height; row++) {
+    if (!screen_buffer->row_changed[row]) continue;
+
+    for (size_t col = 0; col < terminal_width; col++) {
+      size_t offset = row * terminal_width + col;
+
+      Hui_Cell now = screen_buffer->cells[offset];
+      Hui_Cell before = back_buffer.cells[offset];
+      if (!full && now.c == before.c && hui_attr_equal(now.attr, before.attr)) continue;
+
+      // Over the right half of an old wide character, the terminal blanked the left half as well
+      if (!full && col > 0 && before.c == HUI_WIDE_CONTINUATION && now.c != HUI_WIDE_CONTINUATION) {
+        hui_patch_cell(screen_buffer, row, col - 1);
       }
+      if (hui_gap_is_cheap(screen_buffer, row, col)) {
+        for (size_t i = hui_pen.col; i < col; i++) hui_patch_cell(screen_buffer, row, i);
+      }
+      hui_patch_cell(screen_buffer, row, col);
     }
+  }
 
-    if (patches_buffer.size > 0) write(output_fd, patches_buffer.content, patches_buffer.size);
+  size_t written = 0;
+  while (written < patches_buffer.size) {
+    ssize_t n = write(output_fd, patches_buffer.content + written, patches_buffer.size - written);
+    if (n < 0 && errno == EINTR) continue;
+    if (n <= 0) break;
+    written += n;
   }
 
+  hui_frame_stats.frames++;
+  hui_frame_stats.last_frame_bytes = written;
+  hui_frame_stats.total_bytes += written;
+
   curr_buff = !curr_buff;
 }
 
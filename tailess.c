@@ -1,289 +1,4042 @@
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <sys/poll.h>
 #include <unistd.h>
 #include <errno.h>
 #include <fcntl.h>
 #include <assert.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <time.h>
+#ifdef __linux__
+#include <sys/inotify.h>
+#include <sys/eventfd.h>
+#endif
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#endif
 
 #define HOTUI_IMPLEMENTATION
 #include "hotui.h"
+#define HOTRE_IMPLEMENTATION
+#include "hotre.h"
+#define HOTLZ_IMPLEMENTATION
+#include "hotlz.h"
 
 typedef struct {
   char* line;
   size_t count;
+  // Piped lines had their escapes parsed when they came in, this is what is left of them
+  const Hui_Attr_Run* runs;
+  size_t runs_count;
 } Line;
 
+// Piped input is appended to big chunks, lines only reference a slice of them
+#define CHUNK_SIZE (1 << 20)
+// Line_Ref and the attribute runs count in 32 bits. Longer piped lines are cut in several, longer lines
+// of files are only drawn and merged up to there. A run takes 16 bytes and there is at most one a byte,
+// so a line and its runs stay well under 4 GiB
+#define LINE_SIZE_MAX (1 << 27)
+
+typedef struct {
+  char* data;
+  size_t size;
+  size_t capacity;
+  // Cold chunks are compressed and data is NULL, see lines_pack_chunk.
+  // Block k is packed[blocks[k], blocks[k + 1])
+  char* packed;
+  size_t* blocks;
+} Chunk;
+
+typedef struct {
+  // Chunk ids only grow, the full id is recovered from the live ones (see lines_chunk)
+  uint32_t chunk;
+  uint32_t offset;
+  uint32_t count;
+  // The attribute runs follow the text, aligned, see lines_append_line
+  uint32_t runs;
+} Line_Ref;
+
+typedef struct {
+  // offsets[j] is where line j * CHECKPOINT_LINES starts
+  size_t* offsets;
+  size_t count;
+  size_t capacity;
+  // There are `lines` newlines in [0, scanned)
+  size_t scanned;
+  size_t lines;
+  // How much of the file the sidecar on disk covers
+  size_t saved;
+} Line_Checkpoints;
+
+// Several files shown as one, see the Merging files section
+typedef struct Merge Merge;
+
 typedef struct {
-  Line* lines;
+  // Lines are numbered from the first one ever received, only [first, count) are kept.
+  // Piped lines live in a ring, line i is lines[i & (capacity - 1)]
+  Line_Ref* lines;
+  size_t first;
   size_t count;
   size_t capacity;
+  // The chunks are a ring too, [chunks_first, chunks_count) are alive
+  Chunk* chunks;
+  size_t chunks_first;
+  size_t chunks_count;
+  size_t chunks_capacity;
+  // Bytes of the line still being received, they live right after the last chunk size
+  size_t pending;
+  // Retention, 0 means unbounded. bytes is what the kept lines add up to
+  size_t max_lines;
+  size_t max_bytes;
+  size_t bytes;
+  // Names these lines in the cache of unpacked blocks, 0 until something is packed
+  uint64_t id;
+  // File backed mode: lines are read straight from the mapping, we only keep
+  // where each one starts, see lines_offset. Opening at the end numbers the lines
+  // from LINES_TAIL_ID, the ones before are indexed backwards as they are needed
+  char* map;
+  size_t map_size;
+  size_t map_capacity;
+  size_t* offsets;
+  size_t offsets_head;
+  size_t offsets_capacity;
+  size_t indexed;
+  // Set when the ids are made up, the lines were opened at the end before being counted
+  uint8_t unnumbered;
+  Line_Checkpoints checkpoints;
+  // Spilled piped input is appended to an unlinked file mapped like a regular one,
+  // map_size stops at the last complete line until the input ends
+  uint8_t spilling;
+  int spill_fd;
+  size_t spill_size;
+  // Mapped pages away from the view are dropped once this many bytes were read, 0 keeps them
+  size_t window;
+  size_t touched;
+  // Merged files: the lines are copied here in timestamp order as far as they are asked for
+  Merge* merge;
 } Lines;
 
-void line_reserve(Lines* lines, size_t expected_capacity) {
-  if (expected_capacity > lines->capacity) {
-    if (lines->capacity == 0) {
-       lines->capacity = 10;
+/*
+ * Grow a ring keeping the items of [first, count) at the slot their number maps to
+ */
+static void* ring_grow(void* ring, size_t item_size, size_t capacity, size_t new_capacity, size_t first, size_t count) {
+  char* result = malloc(new_capacity * item_size);
+  assert(result != NULL && "Out of memory");
+
+  for (size_t i = first; i < count; i++) {
+    memcpy(result + (i & (new_capacity - 1)) * item_size, (char*) ring + (i & (capacity - 1)) * item_size, item_size);
+  }
+
+  free(ring);
+  return result;
+}
+
+void line_reserve(Lines* lines, size_t expected_capacity) {
+  if (expected_capacity > lines->capacity) {
+    size_t capacity = lines->capacity ? lines->capacity : 16;
+    while(expected_capacity >= capacity) {
+      capacity *= 2;
+    }
+    lines->lines = ring_grow(lines->lines, sizeof(Line_Ref), lines->capacity, capacity, lines->first, lines->count);
+    lines->capacity = capacity;
+  }
+}
+
+size_t lines_chunk_id(Lines* lines, uint32_t chunk) {
+  size_t id = lines->chunks_first + (uint32_t) (chunk - (uint32_t) lines->chunks_first);
+  assert(id < lines->chunks_count && "Line must be inside a chunk");
+  return id;
+}
+
+Chunk* lines_chunk(Lines* lines, uint32_t chunk) {
+  return &lines->chunks[lines_chunk_id(lines, chunk) & (lines->chunks_capacity - 1)];
+}
+
+void push_line(Lines* lines, Line_Ref line) {
+  lines_chunk(lines, line.chunk);
+  line_reserve(lines, lines->count - lines->first + 1);
+  lines->lines[lines->count++ & (lines->capacity - 1)] = line;
+  lines->bytes += line.count;
+}
+
+void chunk_reserve(Lines* lines, size_t expected_capacity) {
+  if (expected_capacity > lines->chunks_capacity) {
+    size_t capacity = lines->chunks_capacity ? lines->chunks_capacity : 16;
+    while(expected_capacity >= capacity) {
+      capacity *= 2;
+    }
+    lines->chunks = ring_grow(lines->chunks, sizeof(Chunk), lines->chunks_capacity, capacity, lines->chunks_first, lines->chunks_count);
+    lines->chunks_capacity = capacity;
+  }
+}
+
+static Chunk* lines_last_chunk(Lines* lines) {
+  if (lines->chunks_count == lines->chunks_first) return NULL;
+  return &lines->chunks[(lines->chunks_count - 1) & (lines->chunks_capacity - 1)];
+}
+
+// ----------------------------------------------------
+// Cold chunks
+// ----------------------------------------------------
+// Only the newest chunks are kept as they are, older ones are compressed as soon
+// as a new chunk starts. Each block of a chunk is compressed on its own, so reading
+// a cold line only unpacks the blocks it lies in. They go to a cache bounded in bytes
+// that the UI thread and the search pool share
+#define HOT_CHUNKS 4
+#define COLD_BLOCK_SIZE (64 << 10)
+#define COLD_CACHE_BYTES (4 << 20)
+
+typedef struct {
+  // Blocks [block, block + blocks) of a chunk of some lines, lines is 0 once they are gone
+  uint64_t lines;
+  size_t chunk;
+  size_t block;
+  size_t blocks;
+  char* data;
+  size_t size;
+  uint64_t used;
+  // Threads still reading it, it is only freed once there are none
+  size_t readers;
+} Cold_Entry;
+
+typedef struct {
+  pthread_mutex_t mutex;
+  Cold_Entry** entries;
+  size_t count;
+  size_t capacity;
+  size_t bytes;
+  uint64_t clock;
+} Cold_Cache;
+
+static atomic_uint_fast64_t lines_next_id = 1;
+static Cold_Cache cold_cache = {
+  .mutex = PTHREAD_MUTEX_INITIALIZER,
+};
+// The entry each thread read last, see lines_chunk_text
+static pthread_key_t cold_reading_key;
+static pthread_once_t cold_reading_once = PTHREAD_ONCE_INIT;
+
+/*
+ * Free the dead entries and the least recently used ones over the budget, as long as nobody
+ * reads them. The mutex must be held
+ */
+static void cold_cache_evict(Cold_Cache* cache) {
+  while (1) {
+    size_t victim = SIZE_MAX;
+    for (size_t i = 0; i < cache->count; i++) {
+      Cold_Entry* entry = cache->entries[i];
+      if (entry->readers) continue;
+      if (!entry->lines) {
+        victim = i;
+        break;
+      }
+      if (cache->bytes > COLD_CACHE_BYTES && (victim == SIZE_MAX || entry->used < cache->entries[victim]->used)) victim = i;
+    }
+    if (victim == SIZE_MAX) return;
+
+    Cold_Entry* entry = cache->entries[victim];
+    cache->bytes -= entry->size;
+    free(entry->data);
+    free(entry);
+    cache->entries[victim] = cache->entries[--cache->count];
+  }
+}
+
+/*
+ * A thread that goes away doesn't read its last entry anymore
+ */
+static void cold_reading_release(void* data) {
+  Cold_Entry* entry = data;
+  pthread_mutex_lock(&cold_cache.mutex);
+  entry->readers--;
+  cold_cache_evict(&cold_cache);
+  pthread_mutex_unlock(&cold_cache.mutex);
+}
+
+static void cold_reading_key_create() {
+  pthread_key_create(&cold_reading_key, cold_reading_release);
+}
+
+/*
+ * Compress a chunk a block at a time, it is left alone when that doesn't save at least an eighth
+ */
+void lines_pack_chunk(Lines* lines, size_t id) {
+  Chunk* chunk = &lines->chunks[id & (lines->chunks_capacity - 1)];
+  if (chunk->packed || chunk->size == 0) return;
+
+  size_t count = (chunk->size + COLD_BLOCK_SIZE - 1) / COLD_BLOCK_SIZE;
+  size_t* blocks = malloc((count + 1) * sizeof(size_t));
+  char* packed = malloc(count * hlz_bound(COLD_BLOCK_SIZE));
+  assert(blocks && packed && "Out of memory");
+
+  blocks[0] = 0;
+  for (size_t k = 0; k < count; k++) {
+    size_t start = k * COLD_BLOCK_SIZE;
+    size_t size = chunk->size - start < COLD_BLOCK_SIZE ? chunk->size - start : COLD_BLOCK_SIZE;
+    blocks[k + 1] = blocks[k] + hlz_compress(chunk->data + start, size, packed + blocks[k]);
+  }
+
+  size_t size = blocks[count];
+  if (size > chunk->size - chunk->size / 8) {
+    free(packed);
+    free(blocks);
+    return;
+  }
+
+  if (!lines->id) lines->id = lines_next_id++;
+
+  chunk->packed = realloc(packed, size);
+  assert(chunk->packed && "Out of memory");
+  chunk->blocks = blocks;
+  free(chunk->data);
+  chunk->data = NULL;
+}
+
+/*
+ * Bytes [offset, offset + size) of a chunk. For a cold one the blocks they lie in are unpacked in
+ * the shared cache, they stay valid until the calling thread reads another cold line
+ */
+char* lines_chunk_text(Lines* lines, size_t id, size_t offset, size_t size) {
+  Chunk* chunk = &lines->chunks[id & (lines->chunks_capacity - 1)];
+  if (!chunk->packed) return chunk->data + offset;
+
+  size_t first = offset / COLD_BLOCK_SIZE;
+  size_t last = (offset + (size ? size - 1 : 0)) / COLD_BLOCK_SIZE;
+  Cold_Cache* cache = &cold_cache;
+  Cold_Entry* entry = NULL;
+
+  pthread_once(&cold_reading_once, cold_reading_key_create);
+  Cold_Entry* previous = pthread_getspecific(cold_reading_key);
+
+  pthread_mutex_lock(&cache->mutex);
+  if (previous) previous->readers--;
+  for (size_t i = 0; i < cache->count; i++) {
+    Cold_Entry* candidate = cache->entries[i];
+    if (candidate->lines == lines->id && candidate->chunk == id && candidate->block <= first && candidate->block + candidate->blocks > last) {
+      entry = candidate;
+      entry->readers++;
+      entry->used = ++cache->clock;
+      break;
+    }
+  }
+  pthread_mutex_unlock(&cache->mutex);
+
+  if (!entry) {
+    // Unpacked outside of the lock, the other threads go on meanwhile
+    size_t start = first * COLD_BLOCK_SIZE;
+    size_t end = (last + 1) * COLD_BLOCK_SIZE < chunk->size ? (last + 1) * COLD_BLOCK_SIZE : chunk->size;
+    entry = malloc(sizeof(Cold_Entry));
+    assert(entry && "Out of memory");
+    *entry = (Cold_Entry) {
+      .lines = lines->id,
+      .chunk = id,
+      .block = first,
+      .blocks = last - first + 1,
+      .data = malloc(end - start),
+      .size = end - start,
+      .readers = 1,
+    };
+    assert(entry->data && "Out of memory");
+
+    for (size_t k = first; k <= last; k++) {
+      size_t at = (k - first) * COLD_BLOCK_SIZE;
+      size_t block_size = end - start - at < COLD_BLOCK_SIZE ? end - start - at : COLD_BLOCK_SIZE;
+      int unpacked = hlz_decompress(chunk->packed + chunk->blocks[k], chunk->blocks[k + 1] - chunk->blocks[k], entry->data + at, block_size);
+      assert(unpacked && "Corrupted cold chunk");
+    }
+
+    pthread_mutex_lock(&cache->mutex);
+    if (cache->count == cache->capacity) {
+      cache->capacity = cache->capacity ? cache->capacity * 2 : 64;
+      cache->entries = realloc(cache->entries, cache->capacity * sizeof(Cold_Entry*));
+      assert(cache->entries && "Out of memory");
+    }
+    cache->entries[cache->count++] = entry;
+    cache->bytes += entry->size;
+    entry->used = ++cache->clock;
+    cold_cache_evict(cache);
+    pthread_mutex_unlock(&cache->mutex);
+  }
+
+  pthread_setspecific(cold_reading_key, entry);
+  return entry->data + (offset - entry->block * COLD_BLOCK_SIZE);
+}
+
+/*
+ * These lines are going away, what was unpacked from them is freed once nobody reads it
+ */
+void lines_forget_cold(Lines* lines) {
+  if (!lines->id) return;
+
+  pthread_mutex_lock(&cold_cache.mutex);
+  for (size_t i = 0; i < cold_cache.count; i++) {
+    if (cold_cache.entries[i]->lines == lines->id) cold_cache.entries[i]->lines = 0;
+  }
+  cold_cache_evict(&cold_cache);
+  pthread_mutex_unlock(&cold_cache.mutex);
+}
+
+/*
+ * Make room for `size` more bytes of the pending line and return where the next one goes.
+ * When the last chunk is full the pending bytes are moved to a new one, so a line never
+ * spans two chunks
+ */
+char* lines_reserve_pending(Lines* lines, size_t size) {
+  Chunk* last = lines_last_chunk(lines);
+
+  if (!last || last->size + lines->pending + size > last->capacity) {
+    size_t capacity = CHUNK_SIZE;
+    if (lines->pending + size > capacity) capacity = lines->pending + size;
+
+    chunk_reserve(lines, lines->chunks_count - lines->chunks_first + 1);
+    last = lines_last_chunk(lines);
+    Chunk* chunk = &lines->chunks[lines->chunks_count++ & (lines->chunks_capacity - 1)];
+    *chunk = (Chunk) {
+      .data = malloc(capacity),
+      .capacity = capacity,
+    };
+    assert(chunk->data && "Out of memory");
+
+    if (last && lines->pending) memcpy(chunk->data, last->data + last->size, lines->pending);
+    last = chunk;
+
+    if (lines->chunks_count - lines->chunks_first > HOT_CHUNKS) lines_pack_chunk(lines, lines->chunks_count - 1 - HOT_CHUNKS);
+  }
+
+  return last->data + last->size + lines->pending;
+}
+
+/*
+ * Turn the pending bytes into a line
+ */
+Line_Ref lines_take_pending(Lines* lines) {
+  if (!lines_last_chunk(lines)) lines_reserve_pending(lines, 0);
+
+  Chunk* last = lines_last_chunk(lines);
+  Line_Ref line = {
+    .chunk = (uint32_t) (lines->chunks_count - 1),
+    .offset = last->size,
+    .count = lines->pending,
+  };
+
+  last->size += lines->pending;
+  lines->pending = 0;
+  return line;
+}
+
+/*
+ * Copy a line and its attribute runs to the end of the last chunk
+ */
+Line_Ref lines_append_line(Lines* lines, const char* text, size_t count, const Hui_Attr_Run* runs, size_t runs_count) {
+  assert(count <= LINE_SIZE_MAX && runs_count <= LINE_SIZE_MAX + 2);
+  size_t runs_size = runs_count * sizeof(Hui_Attr_Run);
+  char* pending = lines_reserve_pending(lines, count + (runs_count ? _Alignof(Hui_Attr_Run) - 1 + runs_size : 0));
+  memcpy(pending, text, count);
+
+  size_t padding = runs_count ? (size_t) (-(uintptr_t) (pending + count)) & (_Alignof(Hui_Attr_Run) - 1) : 0;
+  if (runs_count) memcpy(pending + count + padding, runs, runs_size);
+  lines->pending = count + padding + runs_size;
+
+  Line_Ref line = lines_take_pending(lines);
+  line.count = (uint32_t) count;
+  line.runs = (uint32_t) runs_count;
+  return line;
+}
+
+/*
+ * Take back the last line, it was the last one appended so its bytes go too
+ */
+void lines_drop_last(Lines* lines) {
+  if (lines->count == lines->first) return;
+
+  Line_Ref line = lines->lines[--lines->count & (lines->capacity - 1)];
+  lines->bytes -= line.count;
+  if (lines_chunk_id(lines, line.chunk) == lines->chunks_count - 1) lines_last_chunk(lines)->size = line.offset;
+}
+
+/*
+ * Drop the oldest lines until the retention limits are met, the chunks nobody
+ * references anymore are freed. Return how many lines went away
+ */
+size_t lines_enforce_retention(Lines* lines) {
+  size_t evicted = 0;
+
+  while (lines->first < lines->count) {
+    int too_many_lines = lines->max_lines && lines->count - lines->first > lines->max_lines;
+    int too_many_bytes = lines->max_bytes && lines->bytes > lines->max_bytes && lines->count - lines->first > 1;
+    if (!too_many_lines && !too_many_bytes) break;
+
+    lines->bytes -= lines->lines[lines->first & (lines->capacity - 1)].count;
+    lines->first++;
+    evicted++;
+  }
+
+  if (!evicted) return 0;
+
+  // Everything before the chunk of the oldest line is garbage, the last chunk holds the pending line
+  size_t keep = lines->chunks_count - 1;
+  if (lines->first < lines->count) {
+    Line_Ref oldest = lines->lines[lines->first & (lines->capacity - 1)];
+    keep = lines_chunk_id(lines, oldest.chunk);
+  }
+
+  while (lines->chunks_first < keep) {
+    Chunk* chunk = &lines->chunks[lines->chunks_first & (lines->chunks_capacity - 1)];
+    free(chunk->data);
+    free(chunk->packed);
+    free(chunk->blocks);
+    lines->chunks_first++;
+  }
+
+  return evicted;
+}
+
+// Far enough from 0 that the lines before it never run out of numbers
+#define LINES_TAIL_ID ((size_t) 1 << 62)
+// Jumping further than this in a file that isn't indexed there starts the index over
+#define INDEX_JUMP_DISTANCE (64 << 20)
+
+void offset_reserve(Lines* lines, size_t expected_capacity) {
+  if (expected_capacity > lines->offsets_capacity) {
+    if (lines->offsets_capacity == 0) {
+       lines->offsets_capacity = 1024;
+    }
+    while(expected_capacity >= lines->offsets_capacity) {
+      lines->offsets_capacity *= 2;
+    }
+    lines->offsets = realloc(lines->offsets, (lines->offsets_capacity * sizeof(size_t)));
+
+    assert(lines->offsets != NULL && "Out of memory");
+  }
+}
+
+/*
+ * Make room for `count` more offsets before the first one
+ */
+void offset_reserve_front(Lines* lines, size_t count) {
+  if (lines->offsets_head >= count) return;
+
+  size_t used = lines->count - lines->first + 1;
+  size_t head = used + count + 1024;
+  size_t capacity = head + used * 2 + 1024;
+  size_t* offsets = malloc(capacity * sizeof(size_t));
+  assert(offsets != NULL && "Out of memory");
+
+  memcpy(offsets + head, lines->offsets + lines->offsets_head, used * sizeof(size_t));
+  free(lines->offsets);
+  lines->offsets = offsets;
+  lines->offsets_head = head;
+  lines->offsets_capacity = capacity;
+}
+
+/*
+ * Where line i starts, or where the last one ends for i == count
+ */
+size_t lines_offset(const Lines* lines, size_t i) {
+  return lines->offsets[lines->offsets_head + (i - lines->first)];
+}
+
+/*
+ * Forget the index and start it again at byte `at`, where line `id` starts
+ */
+void lines_restart(Lines* lines, size_t at, size_t id) {
+  lines->unnumbered = id == LINES_TAIL_ID;
+  lines->first = id;
+  lines->count = lines->first;
+  lines->offsets_head = 0;
+  offset_reserve(lines, 1);
+  lines->offsets[0] = at;
+  lines->indexed = at;
+}
+
+// A file that shrank is reloaded before anything reads past its new end (see handle_follow),
+// but it can still be truncated between that check and a read, which then raises SIGBUS.
+// Only for a page of one of our mappings, the page is replaced by zeros so the read can
+// go on. Nothing is indexed while lines_map_truncated is set, the file gets reloaded first
+static volatile sig_atomic_t lines_map_truncated = 0;
+static size_t lines_page_size;
+
+typedef struct {
+  char* start;
+  size_t size;
+} Lines_Map_Range;
+
+// Only changed by the UI thread while nothing reads the mappings
+static Lines_Map_Range* lines_maps;
+static size_t lines_maps_count;
+static size_t lines_maps_capacity;
+
+/*
+ * `map` replaces `old` in the mappings the SIGBUS handler knows, either can be NULL
+ */
+static void lines_track_map(const char* old, char* map, size_t size) {
+  for (size_t i = 0; old && i < lines_maps_count; i++) {
+    if (lines_maps[i].start != old) continue;
+    if (map) lines_maps[i] = (Lines_Map_Range) { map, size };
+    else lines_maps[i] = lines_maps[--lines_maps_count];
+    return;
+  }
+  if (!map) return;
+
+  if (lines_maps_count == lines_maps_capacity) {
+    lines_maps_capacity = lines_maps_capacity ? lines_maps_capacity * 2 : 8;
+    lines_maps = realloc(lines_maps, lines_maps_capacity * sizeof(Lines_Map_Range));
+    assert(lines_maps && "Out of memory");
+  }
+  lines_maps[lines_maps_count++] = (Lines_Map_Range) { map, size };
+}
+
+static void lines_map_fault(int sig, siginfo_t* info, void* context) {
+  (void) context;
+  char* address = info->si_addr;
+
+  for (size_t i = 0; info->si_code == BUS_ADRERR && i < lines_maps_count; i++) {
+    if (address < lines_maps[i].start || address >= lines_maps[i].start + lines_maps[i].size) continue;
+
+    // A plain system call on Linux, nothing it needs can be held by the code we interrupted
+    char* page = (char*) ((uintptr_t) address & ~(uintptr_t) (lines_page_size - 1));
+    if (mmap(page, lines_page_size, PROT_READ, MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED, -1, 0) == MAP_FAILED) break;
+    lines_map_truncated = 1;
+    return;
+  }
+
+  // Not ours, it kills us as it should once the handler returns
+  struct sigaction action = { .sa_handler = SIG_DFL };
+  sigaction(sig, &action, NULL);
+  raise(sig);
+}
+
+static void lines_catch_truncation() {
+  if (lines_page_size) return;
+  lines_page_size = sysconf(_SC_PAGESIZE);
+
+  struct sigaction action = {
+    .sa_sigaction = lines_map_fault,
+    .sa_flags = SA_SIGINFO,
+  };
+  sigemptyset(&action.sa_mask);
+  sigaction(SIGBUS, &action, NULL);
+}
+
+/*
+ * Map the file instead of reading it, return 0 if the fd can't be mapped (pipes, ttys...)
+ * Nothing is indexed yet, see lines_index_until
+ */
+int lines_map_file(Lines* lines, int fd) {
+  struct stat st;
+  if (fstat(fd, &st) < 0 || !S_ISREG(st.st_mode)) return 0;
+  lines_catch_truncation();
+
+  char* map = NULL;
+  if (st.st_size > 0) {
+    map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (map == MAP_FAILED) return 0;
+  }
+
+  lines_track_map(NULL, map, st.st_size);
+  lines->map = map;
+  lines->map_size = st.st_size;
+  lines->map_capacity = st.st_size;
+  lines_restart(lines, 0, 0);
+  return 1;
+}
+
+int lines_is_mapped(Lines* lines) {
+  return lines->offsets != NULL;
+}
+
+// ----------------------------------------------------
+// Spilling piped input to disk
+// ----------------------------------------------------
+// Piped input has no file behind it, so one is made up: the bytes are written to
+// a temp file nobody else can see and read back through a growing mapping
+
+/*
+ * Create the unlinked file in `dir`, return -1 on failure
+ */
+int spill_create(const char* dir) {
+  char path[4096];
+  int n = snprintf(path, sizeof(path), "%s/tailess-XXXXXX", dir);
+  if (n < 0 || (size_t) n >= sizeof(path)) {
+    errno = ENAMETOOLONG;
+    return -1;
+  }
+
+  int fd = mkstemp(path);
+  if (fd < 0) return -1;
+  unlink(path);
+  return fd;
+}
+
+void lines_spill_to(Lines* lines, int fd) {
+  lines->spilling = 1;
+  lines->spill_fd = fd;
+  lines->spill_size = 0;
+  lines->map = NULL;
+  lines->map_size = 0;
+  lines->map_capacity = 0;
+  lines_restart(lines, 0, 0);
+}
+
+/*
+ * Make the mapping of a growing file cover `size` bytes, it grows by doubling so it moves rarely
+ */
+static void lines_grow_map(Lines* lines, int fd, size_t size) {
+  if (lines->map_capacity >= size) return;
+
+  size_t capacity = lines->map_capacity > CHUNK_SIZE ? lines->map_capacity : CHUNK_SIZE;
+  while (capacity < size) {
+    capacity *= 2;
+  }
+
+  // Mapping past the end of the file is fine as long as nobody reads there
+  lines_catch_truncation();
+  char* map = mmap(NULL, capacity, PROT_READ, MAP_SHARED, fd, 0);
+  assert(map != MAP_FAILED && "Could not map the file");
+
+  lines_track_map(lines->map, map, capacity);
+  if (lines->map) munmap(lines->map, lines->map_capacity);
+  lines->map = map;
+  lines->map_capacity = capacity;
+}
+
+static void lines_spill_map(Lines* lines) {
+  lines_grow_map(lines, lines->spill_fd, lines->spill_size);
+}
+
+/*
+ * The mapped file is now `size` bytes long. A last line without newline is
+ * forgotten, it will be indexed again with the rest of it.
+ * Return the line the changes start at
+ */
+size_t lines_file_grew(Lines* lines, int fd, size_t size) {
+  if (lines->count > lines->first && lines->indexed == lines->map_size && lines->map[lines->indexed - 1] != '\n') {
+    lines->count--;
+    lines->indexed = lines_offset(lines, lines->count);
+  }
+
+  lines_grow_map(lines, fd, size);
+  lines->map_size = size;
+  return lines->count;
+}
+
+/*
+ * Append piped bytes, only complete lines become visible
+ */
+void lines_spill_append(Lines* lines, const char* data, size_t size) {
+  size_t written = 0;
+  while (written < size) {
+    ssize_t n = write(lines->spill_fd, data + written, size - written);
+    if (n < 0 && errno == EINTR) continue;
+    assert(n > 0 && "Could not write to the spill file");
+    written += n;
+  }
+  lines->spill_size += size;
+
+  size_t last = size;
+  while (last > 0 && data[last - 1] != '\n') last--;
+  if (last == 0) return;
+
+  lines_spill_map(lines);
+  lines->map_size = lines->spill_size - (size - last);
+}
+
+/*
+ * The input ended, the last line is complete even without a newline
+ */
+void lines_spill_close(Lines* lines) {
+  lines_spill_map(lines);
+  lines->map_size = lines->spill_size;
+}
+
+/*
+ * Forget where the lines before `line` start, lines_index_back_until finds them again
+ */
+static void lines_forget_before(Lines* lines, size_t line) {
+  lines->offsets_head += line - lines->first;
+  lines->first = line;
+
+  // Most of the array is dead, what is left goes back to the front
+  size_t used = lines->count - lines->first + 1;
+  if (lines->offsets_head > used + 1024) {
+    memmove(lines->offsets, lines->offsets + lines->offsets_head, used * sizeof(size_t));
+    lines->offsets_head = 0;
+
+    if (lines->offsets_capacity > used * 4 + 1024) {
+      lines->offsets_capacity = used * 2 + 1024;
+      lines->offsets = realloc(lines->offsets, lines->offsets_capacity * sizeof(size_t));
+      assert(lines->offsets != NULL && "Out of memory");
+    }
+  }
+}
+
+/*
+ * Give back the mapped pages out of a window around byte `center`, they are read again from the file when needed.
+ * The lines starting before the window are forgotten too, or their offsets would grow with the input.
+ * Only done after enough was read since the last time
+ */
+void lines_trim_window(Lines* lines, size_t center) {
+  if (!lines->map || !lines->window || lines->touched < lines->window / 2) return;
+  lines->touched = 0;
+
+  size_t page = sysconf(_SC_PAGESIZE);
+  size_t low = center > lines->window / 2 ? center - lines->window / 2 : 0;
+  size_t high = low + lines->window;
+
+  // First line starting in the window
+  size_t lo = lines->first;
+  size_t hi = lines->count;
+  while (lo < hi) {
+    size_t mid = lo + (hi - lo) / 2;
+    if (lines_offset(lines, mid) < low) lo = mid + 1;
+    else hi = mid;
+  }
+
+  low -= low % page;
+  high += page - 1;
+  high -= high % page;
+
+  if (low > 0) madvise(lines->map, low, MADV_DONTNEED);
+  if (high < lines->map_capacity) madvise(lines->map + high, lines->map_capacity - high, MADV_DONTNEED);
+
+  if (lo > lines->first) lines_forget_before(lines, lo);
+}
+
+// Both are with the merge, it is itself made of indexed files
+void merge_until(Merge* merge, Lines* lines, size_t count);
+int merge_is_done(const Merge* merge);
+
+/*
+ * Split the mapping until we know about at least `count` lines or we reach the end of the file
+ * Heap backed lines are always fully known, unless they are merged from files
+ */
+void lines_index_until(Lines* lines, size_t count) {
+  if (lines->merge) merge_until(lines->merge, lines, count);
+  if (!lines_is_mapped(lines)) return;
+
+  while (lines->count < count && lines->indexed < lines->map_size && !lines_map_truncated) {
+    char* start = lines->map + lines->indexed;
+    char* newline = memchr(start, '\n', lines->map_size - lines->indexed);
+    size_t next = newline ? (size_t) (newline - lines->map) + 1 : lines->map_size;
+    // It may have read the zeros put over a truncated page
+    if (lines_map_truncated) break;
+
+    offset_reserve(lines, lines->offsets_head + lines->count - lines->first + 2);
+    lines->count++;
+    lines->offsets[lines->offsets_head + lines->count - lines->first] = next;
+    lines->touched += next - lines->indexed;
+    lines->indexed = next;
+  }
+}
+
+void lines_index_all(Lines* lines) {
+  lines_index_until(lines, SIZE_MAX);
+}
+
+/*
+ * Last '\n' in [begin, end), a word at a time
+ */
+static const char* find_newline_backwards(const char* begin, const char* end) {
+  const uint64_t ones = 0x0101010101010101ull;
+  const uint64_t highs = 0x8080808080808080ull;
+
+  while (end - begin >= 8) {
+    uint64_t word;
+    memcpy(&word, end - 8, sizeof(word));
+    word ^= ones * '\n';
+    if ((word - ones) & ~word & highs) break;
+    end -= 8;
+  }
+
+  while (end > begin) {
+    if (*--end == '\n') return end;
+  }
+  return NULL;
+}
+
+/*
+ * Does the mapping have lines before the first one we know of
+ */
+int lines_has_unindexed_start(const Lines* lines) {
+  return lines->offsets && lines_offset(lines, lines->first) > 0;
+}
+
+/*
+ * Split the mapping backwards until the first line known is `first` or the start of the file
+ */
+void lines_index_back_until(Lines* lines, size_t first) {
+  if (!lines_is_mapped(lines)) return;
+
+  while (lines->first > first && lines_has_unindexed_start(lines) && !lines_map_truncated) {
+    size_t end = lines_offset(lines, lines->first);
+    // The byte before end is the newline of the previous line
+    const char* newline = find_newline_backwards(lines->map, lines->map + end - 1);
+    size_t start = newline ? (size_t) (newline - lines->map) + 1 : 0;
+    if (lines_map_truncated) break;
+
+    offset_reserve_front(lines, 1);
+    lines->offsets[--lines->offsets_head] = start;
+    lines->first--;
+    lines->touched += end - start;
+  }
+}
+
+Line lines_at(Lines* lines, size_t i) {
+  if (!lines_is_mapped(lines)) {
+    assert(i >= lines->first && i < lines->count && "Line was evicted");
+    Line_Ref ref = lines->lines[i & (lines->capacity - 1)];
+    // The runs are aligned like they were when the line was appended, the chunk and the cache start aligned
+    size_t size = ref.count;
+    if (ref.runs) size = ((ref.offset + ref.count + _Alignof(Hui_Attr_Run) - 1) & ~(_Alignof(Hui_Attr_Run) - 1)) - ref.offset + ref.runs * sizeof(Hui_Attr_Run);
+    char* text = lines_chunk_text(lines, lines_chunk_id(lines, ref.chunk), ref.offset, size);
+    uintptr_t runs = ((uintptr_t) (text + ref.count) + _Alignof(Hui_Attr_Run) - 1) & ~(uintptr_t) (_Alignof(Hui_Attr_Run) - 1);
+    return (Line) {
+      .line = text,
+      .count = ref.count,
+      .runs = ref.runs ? (const Hui_Attr_Run*) runs : NULL,
+      .runs_count = ref.runs,
+    };
+  }
+
+  assert(i >= lines->first && i < lines->count && "Line is not indexed");
+  size_t start = lines_offset(lines, i);
+  size_t end = lines_offset(lines, i + 1);
+  if (end > start && lines->map[end - 1] == '\n') end--;
+
+  return (Line) {
+    .line = lines->map + start,
+    .count = end - start,
+  };
+}
+
+/*
+ * The line of the mapping starting at byte `start`, it doesn't need to be indexed
+ */
+Line lines_at_byte(Lines* lines, size_t start) {
+  const char* newline = memchr(lines->map + start, '\n', lines->map_size - start);
+  size_t end = newline ? (size_t) (newline - lines->map) : lines->map_size;
+
+  return (Line) {
+    .line = lines->map + start,
+    .count = end - start,
+  };
+}
+
+void lines_free(Lines* lines) {
+  if (lines_is_mapped(lines)) {
+    lines_track_map(lines->map, NULL, 0);
+    if (lines->map) munmap(lines->map, lines->map_capacity);
+    if (lines->spilling) close(lines->spill_fd);
+    free(lines->offsets);
+    free(lines->checkpoints.offsets);
+    return;
+  }
+
+  for (size_t i = lines->chunks_first; i < lines->chunks_count; i++) {
+    free(lines->chunks[i & (lines->chunks_capacity - 1)].data);
+    free(lines->chunks[i & (lines->chunks_capacity - 1)].packed);
+    free(lines->chunks[i & (lines->chunks_capacity - 1)].blocks);
+  }
+  lines_forget_cold(lines);
+  free(lines->chunks);
+  free(lines->lines);
+}
+
+// ----------------------------------------------------
+// Line checkpoints
+// ----------------------------------------------------
+// Where every CHECKPOINT_LINES-th line of a mapping starts, counted from the start
+// as far as :N and % need. They give real line numbers to a file opened at the end, and
+// can be kept in a sidecar file so reopening a big file doesn't count it again, the whole
+// file is then counted in idle slices
+#define CHECKPOINT_LINES 4096
+#define CHECKPOINT_SLICE (16 << 20)
+#define CHECKPOINT_MAGIC "TLSIDX1"
+
+typedef size_t (*Count_Newlines)(const char* p, const char* end);
+
+static size_t count_newlines_scalar(const char* p, const char* end) {
+  size_t count = 0;
+  for (; p < end; p++) {
+    count += *p == '\n';
+  }
+  return count;
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+__attribute__((target("sse2,popcnt")))
+static size_t count_newlines_sse2(const char* p, const char* end) {
+  const __m128i nl = _mm_set1_epi8('\n');
+  size_t count = 0;
+
+  while (end - p >= 16) {
+    __m128i v = _mm_loadu_si128((const __m128i*) p);
+    count += __builtin_popcount((uint32_t) _mm_movemask_epi8(_mm_cmpeq_epi8(v, nl)));
+    p += 16;
+  }
+
+  return count + count_newlines_scalar(p, end);
+}
+
+__attribute__((target("avx2,popcnt")))
+static size_t count_newlines_avx2(const char* p, const char* end) {
+  const __m256i nl = _mm256_set1_epi8('\n');
+  size_t count = 0;
+
+  while (end - p >= 32) {
+    __m256i v = _mm256_loadu_si256((const __m256i*) p);
+    count += __builtin_popcount((uint32_t) _mm256_movemask_epi8(_mm256_cmpeq_epi8(v, nl)));
+    p += 32;
+  }
+
+  return count + count_newlines_scalar(p, end);
+}
+#endif
+
+size_t count_newlines(const char* p, const char* end) {
+  static Count_Newlines kernel = NULL;
+
+  if (!kernel) {
+    kernel = count_newlines_scalar;
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("sse2") && __builtin_cpu_supports("popcnt")) kernel = count_newlines_sse2;
+    if (__builtin_cpu_supports("avx2") && __builtin_cpu_supports("popcnt")) kernel = count_newlines_avx2;
+#endif
+  }
+
+  return kernel(p, end);
+}
+
+static void checkpoints_push(Line_Checkpoints* checkpoints, size_t offset) {
+  if (checkpoints->count + 1 > checkpoints->capacity) {
+    checkpoints->capacity = checkpoints->capacity ? checkpoints->capacity * 2 : 64;
+    checkpoints->offsets = realloc(checkpoints->offsets, checkpoints->capacity * sizeof(size_t));
+    assert(checkpoints->offsets != NULL && "Out of memory");
+  }
+  checkpoints->offsets[checkpoints->count++] = offset;
+}
+
+int lines_is_counting(const Lines* lines) {
+  return lines->map && lines->checkpoints.scanned < lines->map_size;
+}
+
+/*
+ * Count up to `budget` more bytes, return 1 if anything was done
+ */
+int lines_count_slice(Lines* lines, size_t budget) {
+  if (!lines_is_counting(lines)) return 0;
+
+  Line_Checkpoints* checkpoints = &lines->checkpoints;
+  if (checkpoints->count == 0) checkpoints_push(checkpoints, 0);
+
+  size_t end = lines->map_size - checkpoints->scanned > budget ? checkpoints->scanned + budget : lines->map_size;
+  lines->touched += end - checkpoints->scanned;
+
+  while (checkpoints->scanned < end) {
+    const char* block = lines->map + checkpoints->scanned;
+    size_t size = end - checkpoints->scanned < 4096 ? end - checkpoints->scanned : 4096;
+    size_t newlines = count_newlines(block, block + size);
+    // The block may be zeros put over a truncated page, it is counted again after the reload
+    if (lines_map_truncated) break;
+    size_t next = checkpoints->count * CHECKPOINT_LINES;
+
+    // A checkpoint starts in this block, only then the newlines are looked at one by one
+    if (checkpoints->lines + newlines >= next) {
+      size_t seen = checkpoints->lines;
+      const char* p = block;
+      while ((p = memchr(p, '\n', block + size - p))) {
+        p++;
+        if (++seen == next) {
+          checkpoints_push(checkpoints, p - lines->map);
+          next += CHECKPOINT_LINES;
+        }
+      }
+    }
+
+    checkpoints->lines += newlines;
+    checkpoints->scanned += size;
+  }
+
+  return 1;
+}
+
+/*
+ * How many lines the mapping has, SIZE_MAX while they are still being counted
+ */
+size_t lines_total(const Lines* lines) {
+  if (!lines->map || lines_is_counting(lines)) return SIZE_MAX;
+  int unterminated = lines->map_size > 0 && lines->map[lines->map_size - 1] != '\n';
+  return lines->checkpoints.lines + unterminated;
+}
+
+/*
+ * Count until the checkpoints reach `byte`, or the end of the mapping
+ */
+static void lines_count_until(Lines* lines, size_t byte) {
+  while (lines->checkpoints.scanned < byte && lines_count_slice(lines, CHECKPOINT_SLICE));
+}
+
+/*
+ * Line `byte` is part of, found from the checkpoint before it
+ */
+size_t lines_line_at_byte(Lines* lines, size_t byte) {
+  if (byte > lines->map_size) byte = lines->map_size;
+  lines_count_until(lines, byte);
+  if (lines->checkpoints.count == 0) return 0;
+
+  Line_Checkpoints* checkpoints = &lines->checkpoints;
+  size_t lo = 0;
+  size_t hi = checkpoints->count;
+  while (hi - lo > 1) {
+    size_t mid = lo + (hi - lo) / 2;
+    if (checkpoints->offsets[mid] <= byte) lo = mid;
+    else hi = mid;
+  }
+
+  const char* start = lines->map + checkpoints->offsets[lo];
+  return lo * CHECKPOINT_LINES + count_newlines(start, lines->map + byte);
+}
+
+/*
+ * Make line number `line` indexed and return its id, the last line if there are not that many.
+ * When it is far from what is indexed the index starts over at the checkpoint before it.
+ * `renumbered` is set when the ids of the lines changed with it
+ */
+size_t lines_seek_line(Lines* lines, size_t line, int* renumbered) {
+  *renumbered = 0;
+  if (!lines->unnumbered && line >= lines->first && line < lines->count) return line;
+  if (!lines->map) return lines->first;
+
+  // Line `line` starts after `line` newlines
+  Line_Checkpoints* checkpoints = &lines->checkpoints;
+  while (checkpoints->lines < line && lines_count_slice(lines, CHECKPOINT_SLICE));
+
+  size_t total = lines_total(lines);
+  if (total != SIZE_MAX && line >= total) line = total > 0 ? total - 1 : 0;
+
+  size_t checkpoint = line / CHECKPOINT_LINES;
+  if (checkpoint >= checkpoints->count) checkpoint = checkpoints->count - 1;
+  size_t at = checkpoints->offsets[checkpoint];
+
+  if (!lines->unnumbered && line >= lines->count && at < lines->indexed + INDEX_JUMP_DISTANCE) {
+    lines_index_until(lines, line + 1);
+  } else if (!lines->unnumbered && line < lines->first && lines_offset(lines, lines->first) < at + INDEX_JUMP_DISTANCE) {
+    lines_index_back_until(lines, line);
+  } else {
+    *renumbered = lines->unnumbered;
+    lines_restart(lines, at, checkpoint * CHECKPOINT_LINES);
+    lines_index_until(lines, line + 1);
+  }
+
+  if (line >= lines->count) line = lines->count > lines->first ? lines->count - 1 : lines->first;
+  return line;
+}
+
+typedef struct {
+  char magic[8];
+  uint64_t device;
+  uint64_t inode;
+  // Bytes the checkpoints cover, the file had that size when they were saved
+  uint64_t size;
+  uint64_t mtime_sec;
+  uint64_t mtime_nsec;
+  uint64_t every;
+  uint64_t lines;
+  uint64_t count;
+} Checkpoints_Header;
+
+/*
+ * $XDG_CACHE_HOME/tailess/<device>-<inode>, the directories are made if needed
+ */
+static int checkpoints_path(char* path, size_t size, const struct stat* st) {
+  const char* cache = getenv("XDG_CACHE_HOME");
+  const char* home = getenv("HOME");
+  int n;
+
+  if (cache && *cache) {
+    mkdir(cache, 0700);
+    n = snprintf(path, size, "%s/tailess", cache);
+  } else if (home && *home) {
+    n = snprintf(path, size, "%s/.cache", home);
+    if (n < 0 || (size_t) n >= size) return 0;
+    mkdir(path, 0700);
+    n = snprintf(path, size, "%s/.cache/tailess", home);
+  } else {
+    return 0;
+  }
+  if (n < 0 || (size_t) n >= size) return 0;
+  mkdir(path, 0700);
+
+  n = snprintf(path + n, size - n, "/%llx-%llx", (unsigned long long) st->st_dev, (unsigned long long) st->st_ino);
+  return n > 0 && (size_t) n < size;
+}
+
+/*
+ * Pick up the checkpoints of an earlier run, if the file only grew since then
+ */
+void checkpoints_load(Lines* lines, int fd) {
+  struct stat st;
+  char path[4096];
+  if (!lines->map || fstat(fd, &st) < 0 || !checkpoints_path(path, sizeof(path), &st)) return;
+
+  FILE* file = fopen(path, "rb");
+  if (!file) return;
+
+  Checkpoints_Header header;
+  size_t* offsets = NULL;
+  int valid = fread(&header, sizeof(header), 1, file) == 1 &&
+              memcmp(header.magic, CHECKPOINT_MAGIC, sizeof(header.magic)) == 0 &&
+              header.device == (uint64_t) st.st_dev && header.inode == (uint64_t) st.st_ino &&
+              header.every == CHECKPOINT_LINES && header.size <= lines->map_size &&
+              header.count > 0 && header.count <= header.lines / CHECKPOINT_LINES + 1;
+
+  // Same size means it must be the same file, otherwise it was appended to
+  if (valid && header.size == lines->map_size) {
+    valid = header.mtime_sec == (uint64_t) st.st_mtim.tv_sec && header.mtime_nsec == (uint64_t) st.st_mtim.tv_nsec;
+  }
+
+  if (valid) {
+    offsets = malloc(header.count * sizeof(size_t));
+    assert(offsets != NULL && "Out of memory");
+    valid = fread(offsets, sizeof(size_t), header.count, file) == header.count;
+  }
+
+  // Cheap sanity check, a checkpoint is always right after a newline
+  for (size_t i = 1; valid && i < header.count; i++) {
+    valid = offsets[i] > offsets[i - 1] && offsets[i] <= header.size && lines->map[offsets[i] - 1] == '\n';
+  }
+
+  fclose(file);
+  if (!valid) {
+    free(offsets);
+    return;
+  }
+
+  free(lines->checkpoints.offsets);
+  lines->checkpoints = (Line_Checkpoints) {
+    .offsets = offsets,
+    .count = header.count,
+    .capacity = header.count,
+    .scanned = header.size,
+    .lines = header.lines,
+    .saved = header.size,
+  };
+}
+
+/*
+ * Write the checkpoints next to the others, if there is anything new since the last time
+ */
+void checkpoints_save(Lines* lines, int fd) {
+  Line_Checkpoints* checkpoints = &lines->checkpoints;
+  struct stat st;
+  char path[4096];
+  char temporary[4200];
+
+  if (checkpoints->count == 0 || checkpoints->scanned == checkpoints->saved) return;
+  if (fstat(fd, &st) < 0 || !checkpoints_path(path, sizeof(path), &st)) return;
+
+  Checkpoints_Header header = {
+    .magic = CHECKPOINT_MAGIC,
+    .device = st.st_dev,
+    .inode = st.st_ino,
+    .size = checkpoints->scanned,
+    .mtime_sec = st.st_mtim.tv_sec,
+    .mtime_nsec = st.st_mtim.tv_nsec,
+    .every = CHECKPOINT_LINES,
+    .lines = checkpoints->lines,
+    .count = checkpoints->count,
+  };
+
+  // Written aside and renamed, so a reader never sees half of it
+  snprintf(temporary, sizeof(temporary), "%s.%d", path, (int) getpid());
+  FILE* file = fopen(temporary, "wb");
+  if (!file) return;
+
+  int written = fwrite(&header, sizeof(header), 1, file) == 1 &&
+                fwrite(checkpoints->offsets, sizeof(size_t), checkpoints->count, file) == checkpoints->count;
+  if (fclose(file) == 0 && written && rename(temporary, path) == 0) {
+    checkpoints->saved = checkpoints->scanned;
+  } else {
+    unlink(temporary);
+  }
+}
+
+typedef struct {
+  char* cstr;
+  size_t size;
+} Sv;
+
+Sv sv_from_cstr(char* cstr, size_t size) {
+  return (Sv) {
+    .cstr = cstr,
+    .size = size,
+  };
+}
+
+Sv sv_chop_by_size(Sv* sv, size_t size) {
+  if (size > sv->size) {
+    size = sv->size;
+  }
+
+  Sv result = sv_from_cstr(sv->cstr, size);
+
+  sv->cstr += size;
+  sv->size -= size;
+
+  return result;
+}
+
+// ----------------------------------------------------
+// Searcher - compiled once per needle
+// ----------------------------------------------------
+// Literal needles use Horspool, regex ones a lazily built DFA (see hotre.h)
+typedef struct {
+  char* needle;
+  size_t size;
+  // How far the window can move when its last byte is a given value
+  uint32_t shift[256];
+  Hre* regex;
+  // Why the last pattern couldn't be compiled
+  const char* error;
+} Searcher;
+
+/*
+ * Copy the needle and precompute whatever the mode needs
+ * Return 0 and set the error if the pattern isn't valid
+ */
+int searcher_compile(Searcher* searcher, const char* needle, size_t size, uint8_t regex) {
+  searcher->error = NULL;
+
+  if (regex) {
+    searcher->regex = hre_compile(needle, size, &searcher->error);
+    if (!searcher->regex) return 0;
+  }
+
+  searcher->needle = malloc(size + 1);
+  assert(searcher->needle && "Out of memory");
+  memcpy(searcher->needle, needle, size);
+  searcher->needle[size] = '\0';
+  searcher->size = size;
+
+  for (size_t i = 0; i < 256; i++) searcher->shift[i] = size;
+  for (size_t i = 0; i + 1 < size; i++) searcher->shift[(uint8_t) needle[i]] = size - 1 - i;
+
+  return 1;
+}
+
+void searcher_free(Searcher* searcher) {
+  free(searcher->needle);
+  hre_free(searcher->regex);
+  searcher->needle = NULL;
+  searcher->regex = NULL;
+  searcher->size = 0;
+  searcher->error = NULL;
+}
+
+int searcher_is_active(const Searcher* searcher) {
+  return searcher->needle != NULL && searcher->size > 0;
+}
+
+/*
+ * Return the first occurrence of the literal needle or NULL.
+ * memchr jumps to the candidates for the first byte, then the
+ * Horspool shift tells how far the next candidate can be
+ */
+char* searcher_find(const Searcher* searcher, const char* haystack, size_t size) {
+  size_t m = searcher->size;
+  if (m == 0 || m > size) return NULL;
+
+  const char* needle = searcher->needle;
+  const char* last = haystack + size - m;
+  const char* p = haystack;
+
+  while (p <= last) {
+    p = memchr(p, needle[0], last - p + 1);
+    if (!p) return NULL;
+
+    if (p[m - 1] == needle[m - 1] && memcmp(p, needle, m - 1) == 0) return (char*) p;
+
+    p += searcher->shift[(uint8_t) p[m - 1]];
+  }
+
+  return NULL;
+}
+
+int searcher_matches(const Searcher* searcher, const char* text, size_t size) {
+  if (searcher->regex) return hre_search(searcher->regex, text, size);
+  return searcher_find(searcher, text, size) != NULL;
+}
+
+/*
+ * The first match at or after `from`, as [start, end) offsets in text
+ */
+int searcher_next(const Searcher* searcher, const char* text, size_t size, size_t from, size_t* start, size_t* end) {
+  if (searcher->regex) return hre_find(searcher->regex, text, size, from, start, end);
+  if (from > size) return 0;
+
+  char* found = searcher_find(searcher, text + from, size - from);
+  if (!found) return 0;
+
+  *start = found - text;
+  *end = *start + searcher->size;
+  return 1;
+}
+
+// ----------------------------------------------------
+// Search pool - n/N split across every core
+// ----------------------------------------------------
+// Lines are handed out in chunks ordered by distance from where the search
+// starts, the nearest match wins and chunks past it are never looked at
+#define SEARCH_CHUNK_LINES 65536
+// Bytes of a mapping nobody split into lines yet, each worker finds the lines of its own chunk
+#define SEARCH_CHUNK_BYTES (4 << 20)
+
+typedef struct {
+  pthread_mutex_t mutex;
+  pthread_cond_t wake;
+  pthread_cond_t idle;
+  pthread_t* threads;
+  size_t threads_count;
+  uint64_t generation;
+  size_t working;
+  uint8_t started;
+  uint8_t quit;
+  // The search being run
+  Lines* lines;
+  const Searcher* searcher;
+  size_t first;
+  size_t count;
+  uint8_t backwards;
+  // first and count are bytes of the mapping, the distance to where the found line starts too.
+  // Backwards it is measured from the end and the chunks are handed from there
+  uint8_t by_bytes;
+  atomic_size_t next_chunk;
+  atomic_size_t found;
+} Search_Pool;
+
+static Search_Pool search_pool = {
+  .mutex = PTHREAD_MUTEX_INITIALIZER,
+  .wake = PTHREAD_COND_INITIALIZER,
+  .idle = PTHREAD_COND_INITIALIZER,
+};
+
+/*
+ * The lines starting in one chunk of bytes, the last one can go on past it.
+ * Backwards the last match of the chunk is the nearest, the whole chunk is looked at
+ */
+static void search_pool_run_bytes(Search_Pool* pool, size_t start, size_t end) {
+  const char* map = pool->lines->map;
+  size_t size = pool->lines->map_size;
+  size_t limit = pool->first + pool->count;
+
+  // The line cut by the start of the chunk belongs to the one before
+  if (start > pool->first && map[start - 1] != '\n') {
+    const char* newline = memchr(map + start, '\n', size - start);
+    if (!newline) return;
+    start = newline - map + 1;
+  }
+
+  while (start < end) {
+    size_t distance = pool->backwards ? limit - start : start - pool->first;
+    if (!pool->backwards && atomic_load_explicit(&pool->found, memory_order_relaxed) < distance) return;
+
+    const char* newline = memchr(map + start, '\n', size - start);
+    size_t line_end = newline ? (size_t) (newline - map) : size;
+    if (searcher_matches(pool->searcher, map + start, line_end - start)) {
+      size_t found = atomic_load(&pool->found);
+      while (distance < found && !atomic_compare_exchange_weak(&pool->found, &found, distance));
+      if (!pool->backwards) return;
+    }
+    start = line_end + 1;
+  }
+}
+
+static void search_pool_run_chunks(Search_Pool* pool) {
+  size_t chunk_size = pool->by_bytes ? SEARCH_CHUNK_BYTES : SEARCH_CHUNK_LINES;
+  size_t chunks = (pool->count + chunk_size - 1) / chunk_size;
+
+  while (1) {
+    size_t chunk = atomic_fetch_add(&pool->next_chunk, 1);
+    if (chunk >= chunks) return;
+
+    size_t start = chunk * chunk_size;
+    size_t end = start + chunk_size < pool->count ? start + chunk_size : pool->count;
+
+    if (pool->by_bytes) {
+      if (atomic_load_explicit(&pool->found, memory_order_relaxed) < start) return;
+      if (pool->backwards) search_pool_run_bytes(pool, pool->first + pool->count - end, pool->first + pool->count - start);
+      else search_pool_run_bytes(pool, pool->first + start, pool->first + end);
+      continue;
+    }
+
+    for (size_t distance = start; distance < end; distance++) {
+      // Something nearer was found, chunks are handed in order so the next ones can't win either
+      if (atomic_load_explicit(&pool->found, memory_order_relaxed) < distance) return;
+
+      size_t i = pool->backwards ? pool->first - distance : pool->first + distance;
+      Line line = lines_at(pool->lines, i);
+      if (searcher_matches(pool->searcher, line.line, line.count)) {
+        size_t found = atomic_load(&pool->found);
+        while (distance < found && !atomic_compare_exchange_weak(&pool->found, &found, distance));
+        break;
+      }
+    }
+  }
+}
+
+static void* search_pool_worker(void* arg) {
+  Search_Pool* pool = arg;
+  uint64_t seen = 0;
+
+  pthread_mutex_lock(&pool->mutex);
+  while (1) {
+    while (!pool->quit && pool->generation == seen) pthread_cond_wait(&pool->wake, &pool->mutex);
+    if (pool->quit) break;
+    seen = pool->generation;
+    pthread_mutex_unlock(&pool->mutex);
+
+    search_pool_run_chunks(pool);
+
+    pthread_mutex_lock(&pool->mutex);
+    if (--pool->working == 0) pthread_cond_signal(&pool->idle);
+  }
+  pthread_mutex_unlock(&pool->mutex);
+
+  return NULL;
+}
+
+/*
+ * One worker per core but one, the calling thread does its share too
+ */
+static void search_pool_start(Search_Pool* pool) {
+  if (pool->started) return;
+  pool->started = 1;
+
+  long cores = sysconf(_SC_NPROCESSORS_ONLN);
+  if (cores <= 1) return;
+
+  pool->threads = malloc((cores - 1) * sizeof(pthread_t));
+  assert(pool->threads && "Out of memory");
+
+  // Signals like SIGWINCH must keep landing on the UI thread. SIGBUS is raised by the
+  // thread reading a truncated file and must be handled there (see lines_map_fault)
+  sigset_t all, previous;
+  sigfillset(&all);
+  sigdelset(&all, SIGBUS);
+  pthread_sigmask(SIG_BLOCK, &all, &previous);
+  for (long i = 0; i < cores - 1; i++) {
+    if (pthread_create(&pool->threads[pool->threads_count], NULL, search_pool_worker, pool) == 0) {
+      pool->threads_count++;
+    }
+  }
+  pthread_sigmask(SIG_SETMASK, &previous, NULL);
+}
+
+void search_pool_free() {
+  Search_Pool* pool = &search_pool;
+
+  pthread_mutex_lock(&pool->mutex);
+  pool->quit = 1;
+  pthread_cond_broadcast(&pool->wake);
+  pthread_mutex_unlock(&pool->mutex);
+
+  for (size_t i = 0; i < pool->threads_count; i++) {
+    pthread_join(pool->threads[i], NULL);
+  }
+  free(pool->threads);
+  pool->threads = NULL;
+  pool->threads_count = 0;
+}
+
+/*
+ * Run the search set up in the pool, the workers only help when there is more than one chunk
+ */
+static void search_pool_run(Search_Pool* pool, size_t chunk_size) {
+  search_pool_start(pool);
+  atomic_store(&pool->next_chunk, 0);
+  atomic_store(&pool->found, SIZE_MAX);
+
+  if (pool->count <= chunk_size || pool->threads_count == 0) {
+    search_pool_run_chunks(pool);
+  } else {
+    pthread_mutex_lock(&pool->mutex);
+    pool->working = pool->threads_count;
+    pool->generation++;
+    pthread_cond_broadcast(&pool->wake);
+    pthread_mutex_unlock(&pool->mutex);
+
+    search_pool_run_chunks(pool);
+
+    pthread_mutex_lock(&pool->mutex);
+    while (pool->working) pthread_cond_wait(&pool->idle, &pool->mutex);
+    pthread_mutex_unlock(&pool->mutex);
+  }
+}
+
+/*
+ * Look at `count` lines starting at `first`, going up when `backwards` is set
+ * Return the nearest matching line or SIZE_MAX
+ */
+size_t search_pool_find(Lines* lines, const Searcher* searcher, size_t first, size_t count, uint8_t backwards) {
+  Search_Pool* pool = &search_pool;
+  if (count == 0) return SIZE_MAX;
+
+  pool->lines = lines;
+  pool->searcher = searcher;
+  pool->first = first;
+  pool->count = count;
+  pool->backwards = backwards;
+  pool->by_bytes = 0;
+  search_pool_run(pool, SEARCH_CHUNK_LINES);
+
+  size_t found = atomic_load(&pool->found);
+  if (found == SIZE_MAX) return SIZE_MAX;
+
+  return backwards ? first - found : first + found;
+}
+
+/*
+ * Look at the lines of the mapping starting in [from, end), `from` starts one. They don't need
+ * to be indexed. Return where the first matching one starts, the last one when `backwards` is set, or SIZE_MAX
+ */
+size_t search_pool_find_bytes(Lines* lines, const Searcher* searcher, size_t from, size_t end, uint8_t backwards) {
+  Search_Pool* pool = &search_pool;
+  if (from >= end) return SIZE_MAX;
+
+  pool->lines = lines;
+  pool->searcher = searcher;
+  pool->first = from;
+  pool->count = end - from;
+  pool->backwards = backwards;
+  pool->by_bytes = 1;
+  search_pool_run(pool, SEARCH_CHUNK_BYTES);
+
+  // What the workers read stays mapped until the window gets trimmed
+  size_t found = atomic_load(&pool->found);
+  lines->touched += found == SIZE_MAX ? pool->count : found;
+  // A match in the zeros put over a truncated page is not one
+  if (lines_map_truncated || found == SIZE_MAX) return SIZE_MAX;
+  return backwards ? end - found : from + found;
+}
+
+// ----------------------------------------------------
+// Match index - sorted lines matching the current needle
+// ----------------------------------------------------
+// Filled a slice at a time while the UI is idle and kept up to date as new
+// lines arrive, so n/N end up being a binary search.
+// It grows forwards, and backwards when lines before the first one get indexed
+#define MATCH_INDEX_SLICE 65536
+// Rows can be added before the first one, they start far from 0
+#define MATCH_INDEX_FIRST_ROW ((size_t) 1 << 62)
+
+typedef struct {
+  // Row r is items[r - base], the ones before begin were evicted along with their lines
+  size_t* items;
+  // Where the line of each item starts in a mapping, the lines there are tested without being indexed
+  size_t* bytes;
+  size_t base;
+  size_t begin;
+  size_t count;
+  size_t capacity;
+  // Lines [from, scanned) were already tested, in a mapping they are the bytes [from_byte, scanned_byte)
+  size_t from;
+  size_t scanned;
+  size_t from_byte;
+  size_t scanned_byte;
+  uint8_t started;
+} Match_Index;
+
+void match_index_reserve(Match_Index* index, size_t expected_capacity) {
+  if (expected_capacity > index->capacity) {
+    if (index->capacity == 0) {
+       index->capacity = 64;
+    }
+    while(expected_capacity >= index->capacity) {
+      index->capacity *= 2;
+    }
+    index->items = realloc(index->items, (index->capacity * sizeof(size_t)));
+    index->bytes = realloc(index->bytes, (index->capacity * sizeof(size_t)));
+
+    assert(index->items != NULL && index->bytes != NULL && "Out of memory");
+  }
+}
+
+/*
+ * Make room for one more item before begin
+ */
+void match_index_reserve_front(Match_Index* index) {
+  if (index->begin > 0) return;
+
+  size_t room = index->capacity > 64 ? index->capacity : 64;
+  size_t* items = malloc((index->capacity + room) * sizeof(size_t));
+  size_t* bytes = malloc((index->capacity + room) * sizeof(size_t));
+  assert(items != NULL && bytes != NULL && "Out of memory");
+
+  if (index->count) {
+    memcpy(items + room, index->items, index->count * sizeof(size_t));
+    memcpy(bytes + room, index->bytes, index->count * sizeof(size_t));
+  }
+  free(index->items);
+  free(index->bytes);
+  index->items = items;
+  index->bytes = bytes;
+  index->capacity += room;
+  index->begin += room;
+  index->count += room;
+  index->base -= room;
+}
+
+void match_index_reset(Match_Index* index) {
+  index->base = MATCH_INDEX_FIRST_ROW;
+  index->begin = 0;
+  index->count = 0;
+  index->from = 0;
+  index->scanned = 0;
+  index->from_byte = 0;
+  index->scanned_byte = 0;
+  index->started = 0;
+}
+
+size_t match_index_first(const Match_Index* index) {
+  return index->base + index->begin;
+}
+
+size_t match_index_end(const Match_Index* index) {
+  return index->base + index->count;
+}
+
+size_t match_index_line(const Match_Index* index, size_t row) {
+  return index->items[row - index->base];
+}
+
+size_t match_index_byte(const Match_Index* index, size_t row) {
+  return index->bytes[row - index->base];
+}
+
+static void match_index_push(Match_Index* index, size_t line, size_t byte) {
+  match_index_reserve(index, index->count + 1);
+  index->items[index->count] = line;
+  index->bytes[index->count++] = byte;
+}
+
+static void match_index_push_front(Match_Index* index, size_t line, size_t byte) {
+  match_index_reserve_front(index);
+  index->items[--index->begin] = line;
+  index->bytes[index->begin] = byte;
+}
+
+/*
+ * The mapped file is about to grow. A last line tested without its newline is tested again
+ * with the rest of it, what it matched is forgotten
+ */
+void match_index_file_grows(Match_Index* index, Lines* lines) {
+  size_t size = lines->map_size;
+  if (!index->started || index->scanned == index->from || index->scanned_byte != size || lines->map[size - 1] == '\n') return;
+
+  const char* newline = find_newline_backwards(lines->map, lines->map + size - 1);
+  index->scanned--;
+  index->scanned_byte = newline ? (size_t) (newline - lines->map) + 1 : 0;
+  if (index->count > index->begin && index->items[index->count - 1] == index->scanned) index->count--;
+}
+
+/*
+ * The last line is about to be replaced, what it matched is forgotten
+ */
+void match_index_forget_last(Match_Index* index, size_t line) {
+  if (index->scanned <= line) return;
+
+  index->scanned = line;
+  if (index->count > index->begin && index->items[index->count - 1] == line) index->count--;
+}
+
+/*
+ * Forget the matches before `first_line`, the array is compacted once most of it is dead
+ */
+void match_index_evict(Match_Index* index, size_t first_line) {
+  while (index->begin < index->count && index->items[index->begin] < first_line) index->begin++;
+  if (index->scanned < first_line) index->scanned = first_line;
+  if (index->from < first_line) index->from = first_line;
+
+  if (index->begin > 1024 && index->begin > index->count / 2) {
+    memmove(index->items, index->items + index->begin, (index->count - index->begin) * sizeof(size_t));
+    memmove(index->bytes, index->bytes + index->begin, (index->count - index->begin) * sizeof(size_t));
+    index->count -= index->begin;
+    index->base += index->begin;
+    index->begin = 0;
+  }
+}
+
+void match_index_free(Match_Index* index) {
+  free(index->items);
+  free(index->bytes);
+  *index = (Match_Index) {0};
+}
+
+static int match_index_forward_complete(Match_Index* index, Lines* lines) {
+  if (lines_is_mapped(lines)) return index->scanned_byte == lines->map_size;
+  int everything_indexed = lines->merge ? merge_is_done(lines->merge) : 1;
+  return everything_indexed && index->scanned == lines->count;
+}
+
+int match_index_complete(Match_Index* index, Lines* lines) {
+  int start_tested = lines_is_mapped(lines) ? index->from_byte == 0 : index->from <= lines->first;
+  return match_index_forward_complete(index, lines) && start_tested;
+}
+
+/*
+ * An index that never tested anything starts at the first line
+ */
+static void match_index_start(Match_Index* index, Lines* lines) {
+  if (lines_is_mapped(lines) ? index->started : index->scanned >= lines->first) return;
+
+  index->from = lines->first;
+  index->scanned = lines->first;
+  index->from_byte = lines_is_mapped(lines) ? lines_offset(lines, lines->first) : 0;
+  index->scanned_byte = index->from_byte;
+  index->started = 1;
+}
+
+/*
+ * Test the next line, it must be the one right after the scanned ones
+ */
+void match_index_test(Match_Index* index, Lines* lines, const Searcher* searcher, size_t i) {
+  assert(i == index->scanned && "Lines must be tested in order");
+  Line line = lines_at(lines, i);
+  lines->touched += line.count;
+  if (searcher_matches(searcher, line.line, line.count)) match_index_push(index, i, 0);
+  index->scanned++;
+}
+
+/*
+ * Test the line of the mapping right after the scanned ones, or right before them when `backwards`
+ * is set. It is found from the bytes, nothing gets indexed
+ */
+static void match_index_test_byte(Match_Index* index, Lines* lines, const Searcher* searcher, uint8_t backwards) {
+  size_t start, end, next = 0;
+  if (backwards) {
+    // The byte before from_byte is the newline of the line before
+    end = index->from_byte - 1;
+    const char* newline = find_newline_backwards(lines->map, lines->map + end);
+    start = newline ? (size_t) (newline - lines->map) + 1 : 0;
+  } else {
+    start = index->scanned_byte;
+    const char* newline = memchr(lines->map + start, '\n', lines->map_size - start);
+    end = newline ? (size_t) (newline - lines->map) : lines->map_size;
+    next = newline ? end + 1 : end;
+  }
+
+  int matches = searcher_matches(searcher, lines->map + start, end - start);
+  // Zeros put over a truncated page, the file gets reloaded and the index with it
+  if (lines_map_truncated) return;
+  lines->touched += end - start;
+
+  if (backwards) {
+    if (matches) match_index_push_front(index, index->from - 1, start);
+    index->from--;
+    index->from_byte = start;
+  } else {
+    if (matches) match_index_push(index, index->scanned, start);
+    index->scanned++;
+    index->scanned_byte = next;
+  }
+}
+
+/*
+ * Test up to `budget` lines before the tested ones. Return 1 if anything was done
+ */
+int match_index_extend_back(Match_Index* index, Lines* lines, const Searcher* searcher, size_t budget) {
+  if (!searcher_is_active(searcher)) return 0;
+  match_index_start(index, lines);
+
+  if (lines_is_mapped(lines)) {
+    if (index->from_byte == 0) return 0;
+    for (size_t i = 0; i < budget && index->from_byte > 0 && !lines_map_truncated; i++) {
+      match_index_test_byte(index, lines, searcher, 1);
+    }
+    return 1;
+  }
+
+  if (index->from <= lines->first) return 0;
+  size_t stop = index->from - lines->first > budget ? index->from - budget : lines->first;
+  while (index->from > stop) {
+    size_t i = index->from - 1;
+    Line line = lines_at(lines, i);
+    lines->touched += line.count;
+    if (searcher_matches(searcher, line.line, line.count)) match_index_push_front(index, i, 0);
+    index->from--;
+  }
+
+  return 1;
+}
+
+/*
+ * Test up to `budget` more lines, after the tested ones first. Return 1 if anything was done
+ */
+int match_index_extend(Match_Index* index, Lines* lines, const Searcher* searcher, size_t budget) {
+  if (!searcher_is_active(searcher) || match_index_complete(index, lines)) return 0;
+  match_index_start(index, lines);
+
+  if (match_index_forward_complete(index, lines)) return match_index_extend_back(index, lines, searcher, budget);
+
+  if (lines_is_mapped(lines)) {
+    for (size_t i = 0; i < budget && index->scanned_byte < lines->map_size && !lines_map_truncated; i++) {
+      match_index_test_byte(index, lines, searcher, 0);
+    }
+    return 1;
+  }
+
+  lines_index_until(lines, index->scanned + budget);
+  size_t end = index->scanned + budget < lines->count ? index->scanned + budget : lines->count;
+  while (index->scanned < end) {
+    match_index_test(index, lines, searcher, index->scanned);
+  }
+
+  return 1;
+}
+
+/*
+ * Row of the first match >= line
+ */
+size_t match_index_lower_bound(Match_Index* index, size_t line) {
+  size_t lo = index->begin;
+  size_t hi = index->count;
+  while (lo < hi) {
+    size_t mid = lo + (hi - lo) / 2;
+    if (index->items[mid] < line) lo = mid + 1;
+    else hi = mid;
+  }
+  return index->base + lo;
+}
+
+// ----------------------------------------------------
+// Parsed lines
+// ----------------------------------------------------
+// The lines drawn are laid out once and kept here by line number: lines of files still have their
+// escapes in the mapping, and lines with UTF-8 need to know which byte is at which column.
+// Piped lines were already parsed when they came in
+#define PARSED_LINES_SLOTS 1024
+// A mark every this many columns, finding a column decodes at most that many characters
+#define PARSED_LINE_COLUMN_STEP 64
+
+typedef struct {
+  uint32_t byte;
+  uint32_t column;
+} Column_Mark;
+
+typedef struct {
+  // What it was parsed from, the slot is stale when lines_at says something else.
+  // Dropped chunks can be allocated again at the same address, so the line number too
+  size_t number;
+  const char* source;
+  size_t source_count;
+  // As drawn, the text is the source itself when it had no escapes
+  Line line;
+  char* text;
+  Hui_Attr_Run* runs;
+  size_t capacity;
+  size_t columns;
+  // marks[k] is the first character at or after column k * PARSED_LINE_COLUMN_STEP,
+  // there are none when every byte is one column
+  Column_Mark* marks;
+  size_t marks_count;
+  size_t marks_capacity;
+  // Where the rows start when wrapped at wrap_width columns, 0 until it is wrapped.
+  // Without marks row k starts at k * wrap_width and only the count is kept
+  size_t wrap_width;
+  size_t wrap_count;
+  size_t* wrap_rows;
+  size_t wrap_capacity;
+} Parsed_Line;
+
+typedef struct {
+  Parsed_Line slots[PARSED_LINES_SLOTS];
+} Parsed_Lines;
+
+void parsed_lines_clear(Parsed_Lines* parsed) {
+  for (size_t i = 0; i < PARSED_LINES_SLOTS; i++) parsed->slots[i].source = NULL;
+}
+
+void parsed_lines_forget(Parsed_Lines* parsed, size_t i) {
+  parsed->slots[i & (PARSED_LINES_SLOTS - 1)].source = NULL;
+}
+
+void parsed_lines_free(Parsed_Lines* parsed) {
+  for (size_t i = 0; i < PARSED_LINES_SLOTS; i++) {
+    free(parsed->slots[i].text);
+    free(parsed->slots[i].runs);
+    free(parsed->slots[i].marks);
+    free(parsed->slots[i].wrap_rows);
+  }
+  free(parsed);
+}
+
+static void parsed_line_layout(Parsed_Line* slot) {
+  const char* text = slot->line.line;
+  size_t count = slot->line.count;
+  slot->marks_count = 0;
+
+  size_t i = 0;
+  while (i < count && (uint8_t) text[i] < 0x80) i++;
+  if (i == count) {
+    slot->columns = count;
+    return;
+  }
+
+  size_t column = 0;
+  for (i = 0; i < count;) {
+    if (column >= slot->marks_count * PARSED_LINE_COLUMN_STEP) {
+      if (slot->marks_count == slot->marks_capacity) {
+        slot->marks_capacity = slot->marks_capacity ? slot->marks_capacity * 2 : 16;
+        slot->marks = realloc(slot->marks, slot->marks_capacity * sizeof(Column_Mark));
+        assert(slot->marks && "Out of memory");
+      }
+      slot->marks[slot->marks_count++] = (Column_Mark) { .byte = i, .column = column };
+    }
+
+    size_t length;
+    column += hui_code_point_width(hui_utf8_decode(text + i, count - i, &length));
+    i += length;
+  }
+  slot->columns = column;
+}
+
+/*
+ * The text of `line` without escapes, its attribute runs and where its columns are. Lines of files start
+ * in the default attributes, what the line before left set isn't known without parsing it too
+ */
+Parsed_Line* parsed_lines_get(Parsed_Lines* parsed, size_t i, Line line, int strip) {
+  Parsed_Line* slot = &parsed->slots[i & (PARSED_LINES_SLOTS - 1)];
+  if (line.count > LINE_SIZE_MAX) line.count = LINE_SIZE_MAX;
+  if (slot->number == i && slot->source == line.line && slot->source_count == line.count) return slot;
+
+  if (!strip) {
+    slot->line = line;
+  } else {
+    if (line.count > slot->capacity) {
+      slot->capacity = line.count;
+      slot->text = realloc(slot->text, slot->capacity);
+      slot->runs = realloc(slot->runs, (slot->capacity / 3 + 1) * sizeof(Hui_Attr_Run));
+      assert(slot->text && slot->runs && "Out of memory");
+    }
+    Hui_Attr attr = {0};
+    size_t runs_count;
+    size_t count = hui_ansi_strip(line.line, line.count, &attr, slot->text, slot->runs, &runs_count);
+    slot->line = (Line) {
+      .line = slot->text,
+      .count = count,
+      .runs = slot->runs,
+      .runs_count = runs_count,
+    };
+  }
+
+  parsed_line_layout(slot);
+  slot->wrap_width = 0;
+  slot->number = i;
+  slot->source = line.line;
+  slot->source_count = line.count;
+  return slot;
+}
+
+static void parsed_line_add_row(Parsed_Line* slot, size_t byte) {
+  if (slot->wrap_count == slot->wrap_capacity) {
+    slot->wrap_capacity = slot->wrap_capacity ? slot->wrap_capacity * 2 : 16;
+    slot->wrap_rows = realloc(slot->wrap_rows, slot->wrap_capacity * sizeof(size_t));
+    assert(slot->wrap_rows && "Out of memory");
+  }
+  slot->wrap_rows[slot->wrap_count++] = byte;
+}
+
+/*
+ * Break the line in rows of `width` columns, a wide character that doesn't fit starts the next one.
+ * It is done again only when the width changes
+ */
+void parsed_line_wrap(Parsed_Line* slot, size_t width) {
+  if (!width) width = 1;
+  if (slot->wrap_width == width) return;
+  slot->wrap_width = width;
+
+  if (!slot->marks_count) {
+    slot->wrap_count = slot->line.count ? (slot->line.count + width - 1) / width : 1;
+    return;
+  }
+
+  slot->wrap_count = 0;
+  parsed_line_add_row(slot, 0);
+  size_t column = 0;
+  for (size_t i = 0; i < slot->line.count;) {
+    size_t length;
+    size_t code_point_width = hui_code_point_width(hui_utf8_decode(slot->line.line + i, slot->line.count - i, &length));
+    if (column + code_point_width > width && column > 0) {
+      parsed_line_add_row(slot, i);
+      column = 0;
+    }
+    column += code_point_width;
+    i += length;
+  }
+}
+
+/*
+ * Byte where a wrapped row starts, past the last one it is the end of the line
+ */
+size_t parsed_line_row_start(const Parsed_Line* slot, size_t row) {
+  if (row >= slot->wrap_count) return slot->line.count;
+  return slot->marks_count ? slot->wrap_rows[row] : row * slot->wrap_width;
+}
+
+/*
+ * Byte of the character drawn at `column`, the column it starts at goes to `start`. Past the end
+ * it is the end of the line
+ */
+size_t parsed_line_byte_at(const Parsed_Line* slot, size_t column, size_t* start) {
+  if (column >= slot->columns) {
+    *start = slot->columns;
+    return slot->line.count;
+  }
+  if (!slot->marks_count) {
+    *start = column;
+    return column;
+  }
+
+  // A wide character can push the first one past the step
+  size_t k = column / PARSED_LINE_COLUMN_STEP;
+  if (k >= slot->marks_count) k = slot->marks_count - 1;
+  while (k > 0 && slot->marks[k].column > column) k--;
+
+  size_t i = slot->marks[k].byte;
+  size_t at = slot->marks[k].column;
+  while (i < slot->line.count) {
+    size_t length;
+    int width = hui_code_point_width(hui_utf8_decode(slot->line.line + i, slot->line.count - i, &length));
+    if (at + width > column) break;
+    at += width;
+    i += length;
+  }
+
+  *start = at;
+  return i;
+}
+
+typedef struct {
+  size_t y;
+  size_t x;
+  // Wrapped, line y is shown from its row `row`. That only holds while y is still `row_of`,
+  // whatever moves y somewhere else starts at the first row of the line
+  size_t row;
+  size_t row_of;
+} Hui_List_Offset;
+
+typedef struct {
+  size_t width;
+  size_t height;
+  size_t x;
+  size_t y;
+  Lines lines;
+  Hui_List_Offset offset;
+  Searcher searcher;
+  Match_Index matches;
+  // When the filter is active only the lines in `filtered` are shown and offset.y is one of its rows
+  Searcher filter;
+  Match_Index filtered;
+  uint8_t following;
+  // Long lines continue on the next rows instead of being cut at the right edge
+  uint8_t wrap;
+  Parsed_Lines* parsed;
+} Hui_List_Window;
+
+Hui_List_Window hui_create_list_window(int width, int height, int y, int x) {
+  Hui_Window win = hui_create_window(width, height, y, x);
+
+  Hui_List_Window list_window = {
+    .width = win.width,
+    .height = win.height,
+    .x = win.x,
+    .y = win.y,
+    .parsed = calloc(1, sizeof(Parsed_Lines)),
+  };
+  assert(list_window.parsed && "Out of memory");
+  match_index_reset(&list_window.matches);
+  match_index_reset(&list_window.filtered);
+  return list_window;
+}
+
+int hui_list_is_filtered(const Hui_List_Window* list_window) {
+  return searcher_is_active(&list_window->filter);
+}
+
+/*
+ * First row still kept, older ones were dropped by the retention limits
+ */
+size_t hui_list_first(const Hui_List_Window* list_window) {
+  return hui_list_is_filtered(list_window) ? match_index_first(&list_window->filtered) : list_window->lines.first;
+}
+
+/*
+ * One past the last row the view has, all the lines or only the filtered ones
+ */
+size_t hui_list_count(const Hui_List_Window* list_window) {
+  return hui_list_is_filtered(list_window) ? match_index_end(&list_window->filtered) : list_window->lines.count;
+}
+
+/*
+ * Line shown at a row of the view
+ */
+size_t hui_list_line(const Hui_List_Window* list_window, size_t row) {
+  return hui_list_is_filtered(list_window) ? match_index_line(&list_window->filtered, row) : row;
+}
+
+/*
+ * Line at the top of the view, `otherwise` when the view is empty
+ */
+size_t hui_list_top_line(const Hui_List_Window* list_window, size_t otherwise) {
+  if (list_window->offset.y < hui_list_first(list_window) || list_window->offset.y >= hui_list_count(list_window)) return otherwise;
+  return hui_list_line(list_window, list_window->offset.y);
+}
+
+/*
+ * Make sure the view knows about at least `rows` rows, if there are that many
+ */
+void hui_list_ensure_rows(Hui_List_Window* list_window, size_t rows) {
+  if (!hui_list_is_filtered(list_window)) {
+    lines_index_until(&list_window->lines, rows);
+    return;
+  }
+
+  // Past the last line match_index_extend goes back, that doesn't add rows here
+  Match_Index* filtered = &list_window->filtered;
+  while (match_index_end(filtered) < rows && !match_index_forward_complete(filtered, &list_window->lines) &&
+         match_index_extend(filtered, &list_window->lines, &list_window->filter, MATCH_INDEX_SLICE));
+}
+
+/*
+ * Same going up, for when the file was opened at the end. Return 1 if rows were added before `row`
+ */
+int hui_list_ensure_rows_before(Hui_List_Window* list_window, size_t row) {
+  size_t first = hui_list_first(list_window);
+  if (row > first) return 1;
+
+  if (!hui_list_is_filtered(list_window)) {
+    lines_index_back_until(&list_window->lines, first > list_window->height ? first - list_window->height : 0);
+    return hui_list_first(list_window) < first;
+  }
+
+  while (match_index_first(&list_window->filtered) == first &&
+         match_index_extend_back(&list_window->filtered, &list_window->lines, &list_window->filter, MATCH_INDEX_SLICE));
+  return hui_list_first(list_window) < first;
+}
+
+/*
+ * Start the index over at the start or the end of the mapping. The match indices don't
+ * depend on what is indexed, they only start over too when the line ids change
+ */
+void hui_restart_list_window(Hui_List_Window* list_window, uint8_t at_end) {
+  Lines* lines = &list_window->lines;
+  // Real line numbers when the lines were counted already
+  size_t total = lines_total(lines);
+  size_t id = !at_end ? 0 : total != SIZE_MAX ? total : LINES_TAIL_ID;
+  if (lines->unnumbered || id == LINES_TAIL_ID) {
+    match_index_reset(&list_window->matches);
+    match_index_reset(&list_window->filtered);
+  }
+  lines_restart(lines, at_end ? lines->map_size : 0, id);
+  parsed_lines_clear(list_window->parsed);
+  list_window->offset.y = lines->first;
+}
+
+/*
+ * Make a line the match index found indexed. Near what is indexed the lines up to it are,
+ * far away the index starts over at it. Return its id, or the nearest one indexed
+ */
+size_t hui_list_reach_line(Hui_List_Window* list_window, size_t line, size_t byte) {
+  Lines* lines = &list_window->lines;
+  if (!lines_is_mapped(lines) || (line >= lines->first && line < lines->count)) return line;
+
+  if (line >= lines->count && byte < lines->indexed + INDEX_JUMP_DISTANCE) {
+    lines_index_until(lines, line + 1);
+  } else if (line < lines->first && lines_offset(lines, lines->first) < byte + INDEX_JUMP_DISTANCE) {
+    lines_index_back_until(lines, line);
+  } else {
+    // Same ids as before, the match indices go on with them
+    uint8_t unnumbered = lines->unnumbered;
+    lines_restart(lines, byte, line);
+    lines->unnumbered = unnumbered;
+    lines_index_until(lines, line + 1);
+  }
+
+  if (line < lines->first) return lines->first;
+  if (line >= lines->count) return lines->count > lines->first ? lines->count - 1 : lines->first;
+  return line;
+}
+
+/*
+ * Text of a row. Filtered lines of a mapping are read where the filter found them, they may not be indexed
+ */
+Line hui_list_row_text(Hui_List_Window* list_window, size_t row) {
+  if (hui_list_is_filtered(list_window) && lines_is_mapped(&list_window->lines)) {
+    return lines_at_byte(&list_window->lines, match_index_byte(&list_window->filtered, row));
+  }
+  return lines_at(&list_window->lines, hui_list_line(list_window, row));
+}
+
+/*
+ * Where the row at the top starts in the mapping, the first line indexed when the view is empty
+ */
+size_t hui_list_top_byte(Hui_List_Window* list_window) {
+  size_t y = list_window->offset.y;
+  if (y < hui_list_first(list_window) || y >= hui_list_count(list_window)) return lines_offset(&list_window->lines, list_window->lines.first);
+  if (hui_list_is_filtered(list_window)) return match_index_byte(&list_window->filtered, y);
+  return lines_offset(&list_window->lines, y);
+}
+
+/*
+ * A row as it is drawn: text without escapes, attribute runs and its columns
+ */
+Parsed_Line* hui_list_row_at(Hui_List_Window* list_window, size_t row) {
+  Line line = hui_list_row_text(list_window, row);
+  int strip = lines_is_mapped(&list_window->lines) && memchr(line.line, '\x1b', line.count);
+  return parsed_lines_get(list_window->parsed, hui_list_line(list_window, row), line, strip);
+}
+
+/*
+ * Draw [from, to) of a line in the attributes of its runs, at column x of the window.
+ * The search highlight only changes the foreground. Return how many columns it took
+ */
+static size_t hui_draw_line_span(Hui_Window win, Line line, size_t from, size_t to, size_t y, size_t x, int highlight) {
+  // The runs that start at or before `from`, the last of them applies there
+  size_t lo = 0, hi = line.runs_count;
+  while (lo < hi) {
+    size_t mid = lo + (hi - lo) / 2;
+    if (line.runs[mid].start <= from) lo = mid + 1;
+    else hi = mid;
+  }
+
+  Hui_Attr attr = lo ? line.runs[lo - 1].attr : (Hui_Attr) {0};
+  size_t next = lo;
+  size_t at = from;
+  size_t columns = 0;
+
+  while (at < to) {
+    while (next < line.runs_count && line.runs[next].start <= at) attr = line.runs[next++].attr;
+    size_t stop = next < line.runs_count && line.runs[next].start < to ? line.runs[next].start : to;
+
+    Hui_Attr drawn = attr;
+    if (highlight) drawn.fg = HUI_COLOR_INDEXED(4);
+    columns += hui_put_text_attr_at_window(win, line.line + at, stop - at, drawn, y, x + columns);
+    at = stop;
+  }
+  return columns;
+}
+
+/*
+ * The next match of a line being drawn, the rows of a wrapped line pass it on
+ * so each one goes on from where the one above stopped
+ */
+typedef struct {
+  size_t from;
+  size_t start;
+  size_t end;
+  // 1 when [start, end) is the next match, -1 when there is none left
+  int found;
+} Line_Matches;
+
+/*
+ * Draw [visible_start, visible_end) of a line from column x of row y, with the search highlight.
+ * Matches are looked for in the whole line, ^ and $ need it, then clipped to what is visible
+ */
+static void hui_draw_line_visible(Hui_List_Window* list_window, Hui_Window win, Line line, Line_Matches* matches, size_t visible_start, size_t visible_end, size_t y, size_t x) {
+  size_t cursor = visible_start;
+
+  while (searcher_is_active(&list_window->searcher) && cursor < visible_end) {
+    if (!matches->found) {
+      matches->found = searcher_next(&list_window->searcher, line.line, line.count, matches->from, &matches->start, &matches->end) ? 1 : -1;
+    }
+    if (matches->found < 0 || matches->start >= visible_end) break;
+
+    size_t start = matches->start;
+    size_t end = matches->end;
+    // Kept when it goes on past this row
+    if (end <= visible_end) {
+      matches->from = end > start ? end : start + 1;
+      matches->found = 0;
+    }
+    if (end <= cursor) continue;
+
+    if (start > cursor) {
+      x += hui_draw_line_span(win, line, cursor, start, y, x, 0);
+      cursor = start;
+    }
+
+    size_t highlight_end = end < visible_end ? end : visible_end;
+    x += hui_draw_line_span(win, line, cursor, highlight_end, y, x, 1);
+    cursor = highlight_end;
+  }
+
+  if (cursor < visible_end) hui_draw_line_span(win, line, cursor, visible_end, y, x, 0);
+}
+
+/*
+ * Wrapped row of the top line at the top of the view
+ */
+static size_t hui_list_top_row(const Hui_List_Window* list_window) {
+  return list_window->offset.row_of == list_window->offset.y ? list_window->offset.row : 0;
+}
+
+static void hui_list_set_top(Hui_List_Window* list_window, size_t y, size_t row) {
+  list_window->offset.y = y;
+  list_window->offset.row = row;
+  list_window->offset.row_of = y;
+}
+
+/*
+ * Rows a row of the view takes wrapped at the width of the window. Only the lines asked
+ * for are laid out, and they stay in the parsed lines until the width changes
+ */
+size_t hui_list_wrapped_rows(Hui_List_Window* list_window, size_t row) {
+  Parsed_Line* parsed = hui_list_row_at(list_window, row);
+  parsed_line_wrap(parsed, list_window->width);
+  return parsed->wrap_count;
+}
+
+static void hui_draw_wrapped_list_window(Hui_List_Window* list_window, Hui_Window win) {
+  size_t count = hui_list_count(list_window);
+  size_t row = hui_list_top_row(list_window);
+  size_t i = 0;
+
+  for (size_t y = list_window->offset.y; i < list_window->height && y < count; y++, row = 0) {
+    Parsed_Line* parsed = hui_list_row_at(list_window, y);
+    parsed_line_wrap(parsed, list_window->width);
+    Line_Matches matches = {0};
+
+    for (; row < parsed->wrap_count && i < list_window->height; row++, i++) {
+      hui_draw_line_visible(list_window, win, parsed->line, &matches, parsed_line_row_start(parsed, row), parsed_line_row_start(parsed, row + 1), i, 0);
+    }
+  }
+}
+
+void hui_draw_list_window(Hui_List_Window list_window) {
+  size_t height = list_window.height;
+  Hui_Window win = {
+    .width = list_window.width,
+    .height = list_window.height,
+    .x = list_window.x,
+    .y = list_window.y,
+  };
+
+  if (list_window.wrap) {
+    hui_draw_wrapped_list_window(&list_window, win);
+    return;
+  }
+
+  size_t count = hui_list_count(&list_window);
+
+  for (size_t i = 0; i < height; i++) {
+    uint64_t offset_y = i + list_window.offset.y;
+    uint64_t offset_x = list_window.offset.x;
+
+    if (offset_y >= count) break;
+
+    Parsed_Line* parsed = hui_list_row_at(&list_window, offset_y);
+    Line line = parsed->line;
+
+    if (!line.count || offset_x >= parsed->columns) continue;
+
+    // offset.x is in columns, the search works on bytes
+    size_t start_column, end_column;
+    size_t visible_start = parsed_line_byte_at(parsed, offset_x, &start_column);
+    size_t visible_end = parsed_line_byte_at(parsed, offset_x + list_window.width, &end_column);
+    size_t x = 0;
+
+    // Cut in half by the left edge, leave its right half blank
+    if (start_column < offset_x) {
+      size_t length;
+      hui_utf8_decode(line.line + visible_start, line.count - visible_start, &length);
+      visible_start += length;
+      x = start_column + 2 - offset_x;
+    }
+
+    Line_Matches matches = {0};
+    hui_draw_line_visible(&list_window, win, line, &matches, visible_start, visible_end, i, x);
+  }
+}
+
+void hui_free_list_window(Hui_List_Window list_window) {
+  lines_free(&list_window.lines);
+  searcher_free(&list_window.searcher);
+  match_index_free(&list_window.matches);
+  searcher_free(&list_window.filter);
+  match_index_free(&list_window.filtered);
+  parsed_lines_free(list_window.parsed);
+}
+
+/*
+ * Top of the wrapped view, line and row, when the last row is at the bottom
+ */
+static void hui_list_wrapped_last_top(Hui_List_Window* list_window, size_t* y, size_t* row) {
+  size_t n = hui_list_count(list_window);
+  size_t left = list_window->height;
+  *y = n > hui_list_first(list_window) ? n - 1 : n;
+  *row = 0;
+  if (*y == n) return;
+
+  while (1) {
+    size_t rows = hui_list_wrapped_rows(list_window, *y);
+    if (rows >= left) {
+      *row = rows - left;
+      return;
+    }
+    left -= rows;
+    if (!hui_list_ensure_rows_before(list_window, *y)) return;
+    (*y)--;
+  }
+}
+
+static void hui_wrapped_scroll_up(Hui_List_Window* list_window, size_t rows) {
+  size_t y = list_window->offset.y;
+  size_t row = hui_list_top_row(list_window);
+
+  while (rows > row) {
+    if (y <= hui_list_first(list_window) && !hui_list_ensure_rows_before(list_window, y)) {
+      row = 0;
+      rows = 0;
+      break;
+    }
+    // Going to the last row of the line before
+    rows -= row + 1;
+    y--;
+    row = hui_list_wrapped_rows(list_window, y) - 1;
+  }
+
+  hui_list_set_top(list_window, y, row - rows);
+}
+
+static void hui_wrapped_scroll_down(Hui_List_Window* list_window, size_t rows) {
+  // Every line is at least a row
+  hui_list_ensure_rows(list_window, list_window->offset.y + rows + list_window->height);
+  size_t last_y, last_row;
+  hui_list_wrapped_last_top(list_window, &last_y, &last_row);
+
+  size_t y = list_window->offset.y;
+  size_t row = hui_list_top_row(list_window);
+  if (y > last_y || (y == last_y && row >= last_row)) return;
+
+  while (y < last_y) {
+    size_t left = hui_list_wrapped_rows(list_window, y) - 1 - row;
+    if (rows <= left) break;
+    rows -= left + 1;
+    y++;
+    row = 0;
+  }
+
+  row += rows;
+  if (y == last_y && row > last_row) row = last_row;
+  hui_list_set_top(list_window, y, row);
+}
+
+/*
+ * Move the top of the view `rows` up, as far as there are rows
+ */
+void hui_scroll_up_list_window(Hui_List_Window* list_window, size_t rows) {
+  if (list_window->wrap) {
+    hui_wrapped_scroll_up(list_window, rows);
+    return;
+  }
+
+  while (list_window->offset.y - hui_list_first(list_window) < rows &&
+         hui_list_ensure_rows_before(list_window, hui_list_first(list_window)));
+
+  size_t room = list_window->offset.y - hui_list_first(list_window);
+  list_window->offset.y -= rows < room ? rows : room;
+}
+
+/*
+ * Row at the top when the last row is at the bottom, as far as rows are known
+ */
+static size_t hui_list_last_top(Hui_List_Window* list_window) {
+  size_t n = hui_list_count(list_window);
+  size_t first = hui_list_first(list_window);
+  return n - first > list_window->height ? n - list_window->height : first;
+}
+
+/*
+ * Move the top of the view `rows` down, the last row stays at the bottom
+ */
+void hui_scroll_down_list_window(Hui_List_Window* list_window, size_t rows) {
+  if (list_window->wrap) {
+    hui_wrapped_scroll_down(list_window, rows);
+    return;
+  }
+
+  hui_list_ensure_rows(list_window, list_window->offset.y + rows + list_window->height);
+  size_t last = hui_list_last_top(list_window);
+
+  if (list_window->offset.y >= last) return;
+  list_window->offset.y = last - list_window->offset.y > rows ? list_window->offset.y + rows : last;
+}
+
+void hui_go_up_list_window(Hui_List_Window* list_window) {
+  hui_scroll_up_list_window(list_window, 1);
+}
+
+void hui_page_up_list_window(Hui_List_Window* list_window) {
+  hui_scroll_up_list_window(list_window, list_window->height);
+}
+
+void hui_go_down_list_window(Hui_List_Window* list_window) {
+  hui_scroll_down_list_window(list_window, 1);
+}
+
+void hui_page_down_list_window(Hui_List_Window* list_window) {
+  hui_scroll_down_list_window(list_window, list_window->height);
+}
+
+void hui_end_list_window(Hui_List_Window* list_window) {
+  Lines* lines = &list_window->lines;
+  if (!hui_list_is_filtered(list_window) && lines_is_mapped(lines) && lines->map_size - lines->indexed > INDEX_JUMP_DISTANCE) {
+    hui_restart_list_window(list_window, 1);
+  }
+
+  hui_list_ensure_rows(list_window, SIZE_MAX);
+  while (hui_list_count(list_window) - hui_list_first(list_window) < list_window->height &&
+         hui_list_ensure_rows_before(list_window, hui_list_first(list_window)));
+  size_t n = hui_list_count(list_window);
+  size_t first = hui_list_first(list_window);
+
+  if (list_window->wrap) {
+    size_t y, row;
+    hui_list_wrapped_last_top(list_window, &y, &row);
+    hui_list_set_top(list_window, y < n ? y : first, row);
+  } else if (n - first > list_window->height) {
+    list_window->offset.y = n - list_window->height;
+  } else {
+    list_window->offset.y = first;
+  }
+}
+
+void hui_go_left_list_window(Hui_List_Window* list_window) {
+  if (list_window->offset.x > 0) list_window->offset.x--;
+}
+
+void hui_go_right_list_window(Hui_List_Window* list_window) {
+  // Nothing is cut at the right edge when wrapping
+  if (!list_window->wrap) list_window->offset.x++;
+}
+
+/*
+ * Wrap long lines or cut them at the right edge again. The line at the top stays there
+ */
+void hui_toggle_wrap_list_window(Hui_List_Window* list_window) {
+  list_window->wrap = !list_window->wrap;
+  list_window->offset.x = 0;
+  hui_list_set_top(list_window, list_window->offset.y, 0);
+  if (list_window->following) hui_end_list_window(list_window);
+}
+
+void hui_push_line_list_window(Hui_List_Window* list_window, Line_Ref line) {
+  push_line(&list_window->lines, line);
+
+  size_t n = list_window->lines.count;
+
+  if (lines_enforce_retention(&list_window->lines)) {
+    match_index_evict(&list_window->matches, list_window->lines.first);
+    match_index_evict(&list_window->filtered, list_window->lines.first);
+  }
+
+  // Keep up to date indices current, otherwise the idle slices will get here
+  Match_Index* matches = &list_window->matches;
+  if (searcher_is_active(&list_window->searcher) && matches->scanned == n - 1) {
+    match_index_test(matches, &list_window->lines, &list_window->searcher, n - 1);
+  }
+
+  Match_Index* filtered = &list_window->filtered;
+  if (hui_list_is_filtered(list_window) && filtered->scanned == n - 1) {
+    match_index_test(filtered, &list_window->lines, &list_window->filter, n - 1);
+  }
+
+  size_t first = hui_list_first(list_window);
+  if (list_window->offset.y < first) list_window->offset.y = first;
+
+  // Wrapped, the bottom depends on how many rows the last lines take. That is settled once per frame
+  if (hui_list_count(list_window) - first > list_window->height && list_window->following && !list_window->wrap) hui_end_list_window(list_window);
+}
+
+/*
+ * Take back the last line, a longer one is pushed in its place
+ */
+void hui_pop_line_list_window(Hui_List_Window* list_window) {
+  Lines* lines = &list_window->lines;
+  if (lines->count == lines->first) return;
+
+  size_t last = lines->count - 1;
+  match_index_forget_last(&list_window->matches, last);
+  match_index_forget_last(&list_window->filtered, last);
+  parsed_lines_forget(list_window->parsed, last);
+  lines_drop_last(lines);
+}
+
+/*
+ * Drop what the mapping keeps away from the view. The match indices test lines from
+ * the bytes, they don't need any of it
+ */
+void hui_trim_list_window(Hui_List_Window* list_window) {
+  if (!lines_is_mapped(&list_window->lines)) return;
+  lines_trim_window(&list_window->lines, hui_list_top_byte(list_window));
+}
+
+void hui_home_list_window(Hui_List_Window* list_window) {
+  Lines* lines = &list_window->lines;
+  if (!hui_list_is_filtered(list_window) && lines_has_unindexed_start(lines) && lines_offset(lines, lines->first) > INDEX_JUMP_DISTANCE) {
+    hui_restart_list_window(list_window, 0);
+  }
+
+  while (hui_list_ensure_rows_before(list_window, hui_list_first(list_window)));
+  list_window->offset.y = hui_list_first(list_window);
+}
+
+/*
+ * Put line number `line` at the top, in the filtered view the first match from there
+ */
+void hui_go_to_line_list_window(Hui_List_Window* list_window, size_t line) {
+  Lines* lines = &list_window->lines;
+  int renumbered = 0;
+
+  if (lines_is_mapped(lines)) {
+    line = lines_seek_line(lines, line, &renumbered);
+  } else if (lines->count == lines->first) {
+    return;
+  } else if (line < lines->first || line >= lines->count) {
+    line = line < lines->first ? lines->first : lines->count - 1;
+  }
+
+  if (renumbered) {
+    match_index_reset(&list_window->matches);
+    match_index_reset(&list_window->filtered);
+  }
+
+  size_t row = line;
+  if (hui_list_is_filtered(list_window)) {
+    Match_Index* filtered = &list_window->filtered;
+    while (line < filtered->from && match_index_extend_back(filtered, lines, &list_window->filter, MATCH_INDEX_SLICE));
+    while (line >= filtered->scanned && match_index_extend(filtered, lines, &list_window->filter, MATCH_INDEX_SLICE));
+    row = match_index_lower_bound(filtered, line);
+  }
+
+  // Near the end the last page is shown instead
+  hui_list_ensure_rows(list_window, row + list_window->height);
+  size_t last = hui_list_last_top(list_window);
+  list_window->offset.y = row < last ? row : last;
+}
+
+/*
+ * Put the line `percent` of the way through the input at the top, by bytes for files
+ */
+void hui_go_to_percent_list_window(Hui_List_Window* list_window, size_t percent) {
+  Lines* lines = &list_window->lines;
+  if (percent > 100) percent = 100;
+
+  if (lines_is_mapped(lines)) {
+    size_t byte = lines->map_size / 100 * percent + lines->map_size % 100 * percent / 100;
+    hui_go_to_line_list_window(list_window, lines_line_at_byte(lines, byte));
+  } else {
+    hui_go_to_line_list_window(list_window, lines->first + (lines->count - lines->first) * percent / 100);
+  }
+}
+
+/*
+ * Open at the end showing the last `count` lines, only those get indexed
+ */
+void hui_tail_list_window(Hui_List_Window* list_window, size_t count) {
+  Lines* lines = &list_window->lines;
+  if (!lines_is_mapped(lines)) return;
+
+  hui_restart_list_window(list_window, 1);
+  lines_index_back_until(lines, lines->count > count ? lines->count - count : 0);
+  list_window->offset.y = lines->first;
+}
+
+/*
+ * Only show the lines matching the pattern, an empty one shows everything again
+ */
+void hui_set_filter_list_window(Hui_List_Window* list_window, const char* pattern, size_t size, uint8_t regex) {
+  size_t top = hui_list_top_line(list_window, list_window->lines.first);
+  size_t top_byte = lines_is_mapped(&list_window->lines) ? hui_list_top_byte(list_window) : 0;
+
+  searcher_free(&list_window->filter);
+  match_index_reset(&list_window->filtered);
+  if (size > 0) searcher_compile(&list_window->filter, pattern, size, regex);
+
+  // The filtered rows are only known as the index gets filled, start from the top
+  list_window->offset.y = hui_list_is_filtered(list_window) ? hui_list_first(list_window) : hui_list_reach_line(list_window, top, top_byte);
+  if (list_window->following) hui_end_list_window(list_window);
+}
+
+/*
+ * Does the needle match the line of a row, the match index knows for the lines it scanned
+ */
+int hui_list_row_matches(Hui_List_Window* list_window, size_t row) {
+  Match_Index* matches = &list_window->matches;
+  size_t line = hui_list_line(list_window, row);
+  if (line >= matches->from && line < matches->scanned) {
+    size_t found = match_index_lower_bound(matches, line);
+    return found < match_index_end(matches) && match_index_line(matches, found) == line;
+  }
+
+  Line content = hui_list_row_text(list_window, row);
+  return searcher_matches(&list_window->searcher, content.line, content.count);
+}
+
+/*
+ * The filtered view is walked row by row, skipping the lines that don't match the needle
+ */
+int hui_go_to_filtered_occurrence(Hui_List_Window* list_window, uint8_t backwards) {
+  size_t row = list_window->offset.y;
+
+  while (1) {
+    if (backwards) {
+      if (!hui_list_ensure_rows_before(list_window, row)) return 0;
+      row--;
+    } else {
+      row++;
+      hui_list_ensure_rows(list_window, row + 1);
+      if (row >= hui_list_count(list_window)) return 0;
+    }
+
+    if (hui_list_row_matches(list_window, row)) {
+      list_window->offset.y = row;
+      return 1;
+    }
+  }
+}
+
+/*
+ * In a mapping the pool searches the bytes on either side of what the match index tested,
+ * the line found is indexed for the view once it is known
+ */
+static int hui_go_to_next_mapped_occurrence(Hui_List_Window* list_window) {
+  Lines* lines = &list_window->lines;
+  Match_Index* matches = &list_window->matches;
+  const Searcher* searcher = &list_window->searcher;
+  match_index_start(matches, lines);
+
+  // After the top line
+  size_t first = list_window->offset.y < lines->count ? list_window->offset.y + 1 : lines->count;
+  size_t byte = lines_offset(lines, first);
+  size_t found = SIZE_MAX;
+  size_t line = 0;
+
+  // Before the tested lines
+  if (byte < matches->from_byte) {
+    found = search_pool_find_bytes(lines, searcher, byte, matches->from_byte, 0);
+    if (found != SIZE_MAX) line = first + count_newlines(lines->map + byte, lines->map + found);
+  }
+
+  size_t row = match_index_lower_bound(matches, first);
+  if (found == SIZE_MAX && row < match_index_end(matches)) {
+    line = match_index_line(matches, row);
+    found = match_index_byte(matches, row);
+  }
+
+  // After them
+  if (found == SIZE_MAX) {
+    size_t from = byte > matches->scanned_byte ? byte : matches->scanned_byte;
+    size_t from_line = byte > matches->scanned_byte ? first : matches->scanned;
+    found = search_pool_find_bytes(lines, searcher, from, lines->map_size, 0);
+    if (found != SIZE_MAX) line = from_line + count_newlines(lines->map + from, lines->map + found);
+  }
+
+  if (found == SIZE_MAX) return 0;
+  list_window->offset.y = hui_list_reach_line(list_window, line, found);
+  return 1;
+}
+
+static int hui_go_to_previous_mapped_occurrence(Hui_List_Window* list_window) {
+  Lines* lines = &list_window->lines;
+  Match_Index* matches = &list_window->matches;
+  const Searcher* searcher = &list_window->searcher;
+  match_index_start(matches, lines);
+
+  // Lines before `end` are left to look at
+  size_t end = list_window->offset.y < lines->count ? list_window->offset.y : lines->count;
+  size_t byte = lines_offset(lines, end);
+  size_t found = SIZE_MAX;
+  size_t line = 0;
+
+  // After the tested lines
+  if (byte > matches->scanned_byte) {
+    found = search_pool_find_bytes(lines, searcher, matches->scanned_byte, byte, 1);
+    if (found != SIZE_MAX) line = end - count_newlines(lines->map + found, lines->map + byte);
+  }
+
+  size_t row = match_index_lower_bound(matches, end);
+  if (found == SIZE_MAX && row > match_index_first(matches)) {
+    line = match_index_line(matches, row - 1);
+    found = match_index_byte(matches, row - 1);
+  }
+
+  // Before them
+  if (found == SIZE_MAX) {
+    size_t until = byte < matches->from_byte ? byte : matches->from_byte;
+    size_t until_line = byte < matches->from_byte ? end : matches->from;
+    found = search_pool_find_bytes(lines, searcher, 0, until, 1);
+    if (found != SIZE_MAX) line = until_line - count_newlines(lines->map + found, lines->map + until);
+  }
+
+  if (found == SIZE_MAX) return 0;
+  list_window->offset.y = hui_list_reach_line(list_window, line, found);
+  return 1;
+}
+
+/*
+ * The match index answers for the lines it already scanned, the pool searches the rest
+ */
+int hui_go_to_next_occurrence(Hui_List_Window* list_window) {
+  if (!searcher_is_active(&list_window->searcher)) return 0;
+  if (hui_list_is_filtered(list_window)) return hui_go_to_filtered_occurrence(list_window, 0);
+  if (lines_is_mapped(&list_window->lines)) return hui_go_to_next_mapped_occurrence(list_window);
+
+  Match_Index* matches = &list_window->matches;
+  size_t first = list_window->offset.y + 1;
+  size_t found;
+
+  size_t row = match_index_lower_bound(matches, first);
+  if (row < match_index_end(matches)) {
+    list_window->offset.y = match_index_line(matches, row);
+    return 1;
+  }
+
+  // Merged lines only exist once merged
+  Lines* lines = &list_window->lines;
+  lines_index_all(lines);
+
+  if (first < matches->scanned) first = matches->scanned;
+  if (first < lines->first) first = lines->first;
+  if (first >= lines->count) return 0;
+
+  found = search_pool_find(lines, &list_window->searcher, first, lines->count - first, 0);
+  if (found == SIZE_MAX) return 0;
+
+  list_window->offset.y = found;
+  return 1;
+}
+
+int hui_go_to_previous_occurrence(Hui_List_Window* list_window) {
+  if (!searcher_is_active(&list_window->searcher)) return 0;
+  if (hui_list_is_filtered(list_window)) return hui_go_to_filtered_occurrence(list_window, 1);
+  if (lines_is_mapped(&list_window->lines)) return hui_go_to_previous_mapped_occurrence(list_window);
+
+  Lines* lines = &list_window->lines;
+  Match_Index* matches = &list_window->matches;
+  size_t found = SIZE_MAX;
+  // Lines before `end` are left to look at
+  size_t end = list_window->offset.y;
+
+  // After the tested lines
+  size_t first = matches->scanned > lines->first ? matches->scanned : lines->first;
+  if (end > first) {
+    found = search_pool_find(lines, &list_window->searcher, end - 1, end - first, 1);
+    end = first;
+  }
+
+  // The tested lines
+  if (found == SIZE_MAX && end > matches->from && matches->from < matches->scanned) {
+    size_t row = match_index_lower_bound(matches, end);
+    if (row > match_index_first(matches)) found = match_index_line(matches, row - 1);
+    end = matches->from;
+  }
+
+  // Before them
+  if (found == SIZE_MAX && end > lines->first) {
+    found = search_pool_find(lines, &list_window->searcher, end - 1, end - lines->first, 1);
+  }
+
+  if (found == SIZE_MAX) return 0;
+
+  list_window->offset.y = found;
+  return 1;
+}
+
+/*
+ * One slice of the background indexing, match index first, then the filter
+ * Return 1 if anything shown changed
+ */
+int hui_index_matches_list_window(Hui_List_Window* list_window) {
+  if (match_index_extend(&list_window->matches, &list_window->lines, &list_window->searcher, MATCH_INDEX_SLICE)) return 1;
+  return match_index_extend(&list_window->filtered, &list_window->lines, &list_window->filter, MATCH_INDEX_SLICE);
+}
+
+int hui_list_is_indexing(Hui_List_Window* list_window) {
+  int searching = searcher_is_active(&list_window->searcher) && !match_index_complete(&list_window->matches, &list_window->lines);
+  int filtering = hui_list_is_filtered(list_window) && !match_index_complete(&list_window->filtered, &list_window->lines);
+  return searching || filtering;
+}
+
+/*
+ * "match k of N" when the top line is a match, "N matches" otherwise.
+ * A + means the index is still being filled
+ */
+void hui_draw_match_status(Hui_List_Window* list_window, Hui_Window window) {
+  char buffer[128];
+  int n;
+
+  if (list_window->searcher.error) {
+    n = snprintf(buffer, sizeof(buffer), "Invalid regex: %s", list_window->searcher.error);
+    if ((size_t) n < window.width) hui_put_text_at_window(window, buffer, n, 0, window.width - n);
+    return;
+  }
+
+  if (!searcher_is_active(&list_window->searcher)) return;
+
+  Match_Index* matches = &list_window->matches;
+  const char* more = match_index_complete(matches, &list_window->lines) ? "" : "+";
+  size_t top = hui_list_top_line(list_window, SIZE_MAX);
+  size_t row = match_index_lower_bound(matches, top);
+  size_t first = match_index_first(matches);
+  size_t total = match_index_end(matches) - first;
+
+  if (row < match_index_end(matches) && match_index_line(matches, row) == top) {
+    n = snprintf(buffer, sizeof(buffer), "match %zu of %zu%s", row - first + 1, total, more);
+  } else {
+    n = snprintf(buffer, sizeof(buffer), "%zu matches%s", total, more);
+  }
+
+  if ((size_t) n < window.width) hui_put_text_at_window(window, buffer, n, 0, window.width - n);
+}
+
+/*
+ * "&pattern: N lines", next to the follow status
+ */
+void hui_draw_filter_status(Hui_List_Window* list_window, Hui_Window window) {
+  char buffer[128];
+  int n;
+
+  if (list_window->filter.error) {
+    n = snprintf(buffer, sizeof(buffer), "Invalid filter: %s", list_window->filter.error);
+  } else if (hui_list_is_filtered(list_window)) {
+    const char* more = match_index_complete(&list_window->filtered, &list_window->lines) ? "" : "+";
+    n = snprintf(buffer, sizeof(buffer), "&%.40s: %zu lines%s", list_window->filter.needle, hui_list_count(list_window) - hui_list_first(list_window), more);
+  } else {
+    return;
+  }
+
+  if ((size_t) n + 12 < window.width) hui_put_text_at_window(window, buffer, n, 0, 12);
+}
+
+/*
+ * What the previous frame cost on the wire, shown with --stats
+ */
+void hui_draw_frame_stats(Hui_Window window) {
+  Hui_Stats stats = hui_stats();
+  char buffer[128];
+  size_t average = stats.frames ? stats.total_bytes / stats.frames : 0;
+  int n = snprintf(buffer, sizeof(buffer), "frame %zu: %zu bytes, %zu avg", stats.frames, stats.last_frame_bytes, average);
+
+  if ((size_t) n < window.width) hui_put_text_at_window(window, buffer, n, 0, window.width - n);
+}
+
+/*
+ * The file behind the view grew, the new lines get indexed lazily
+ */
+void hui_file_grew_list_window(Hui_List_Window* list_window, int fd, size_t size) {
+  match_index_file_grows(&list_window->matches, &list_window->lines);
+  match_index_file_grows(&list_window->filtered, &list_window->lines);
+  lines_file_grew(&list_window->lines, fd, size);
+  if (list_window->following) hui_end_list_window(list_window);
+}
+
+/*
+ * Start over with another file, or the same one after it was truncated
+ */
+void hui_reload_list_window(Hui_List_Window* list_window, int fd) {
+  Lines* lines = &list_window->lines;
+  size_t window = lines->window;
+
+  lines_free(lines);
+  *lines = (Lines) {
+    .window = window,
+  };
+  lines_map_file(lines, fd);
+
+  match_index_reset(&list_window->matches);
+  match_index_reset(&list_window->filtered);
+  parsed_lines_clear(list_window->parsed);
+  list_window->offset.y = 0;
+  if (list_window->following) hui_end_list_window(list_window);
+}
+
+// ----------------------------------------------------
+// Following files
+// ----------------------------------------------------
+// A regular file always polls as readable, so it is never put in the poll set.
+// inotify says when it changed or when its name got a new file (logrotate),
+// without it the file is looked at once a second
+#define FOLLOW_POLL_INTERVAL_MS 1000
+
+/*
+ * Milliseconds since `since`
+ */
+long elapsed_ms(const struct timespec* since) {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (now.tv_sec - since->tv_sec) * 1000 + (now.tv_nsec - since->tv_nsec) / 1000000;
+}
+
+typedef struct {
+  uint8_t active;
+  const char* path;
+  // Base name of path, to recognize the events of its directory
+  const char* name;
+  int fd;
+  dev_t device;
+  ino_t inode;
+  // -1 when polling
+  int inotify;
+  int file_watch;
+  struct timespec checked;
+} Follow;
+
+#ifdef __linux__
+#define FOLLOW_FILE_EVENTS (IN_MODIFY | IN_ATTRIB | IN_MOVE_SELF | IN_DELETE_SELF)
+#endif
+
+/*
+ * Start looking at the file, it is polled until follow_watch says otherwise
+ */
+void follow_open(Follow* follow, const char* path, int fd) {
+  struct stat st;
+  fstat(fd, &st);
+
+  const char* slash = strrchr(path, '/');
+  *follow = (Follow) {
+    .active = 1,
+    .path = path,
+    .name = slash ? slash + 1 : path,
+    .fd = fd,
+    .device = st.st_dev,
+    .inode = st.st_ino,
+    .inotify = -1,
+  };
+  clock_gettime(CLOCK_MONOTONIC, &follow->checked);
+}
+
+/*
+ * Watch the file and its directory with `inotify`, several files can share one.
+ * Return 0 if that can't be done
+ */
+int follow_watch(Follow* follow, int inotify) {
+#ifdef __linux__
+  char directory[4096];
+  const char* slash = strrchr(follow->path, '/');
+  size_t size = slash ? (size_t) (slash - follow->path) : 0;
+  if (size >= sizeof(directory)) return 0;
+  if (slash && size == 0) size = 1;
+  memcpy(directory, slash ? follow->path : ".", slash ? size : 1);
+  directory[slash ? size : 1] = '\0';
+
+  follow->file_watch = inotify_add_watch(inotify, follow->path, FOLLOW_FILE_EVENTS);
+  if (follow->file_watch < 0 || inotify_add_watch(inotify, directory, IN_CREATE | IN_MOVED_TO) < 0) return 0;
+  follow->inotify = inotify;
+  return 1;
+#else
+  (void) follow;
+  (void) inotify;
+  return 0;
+#endif
+}
+
+/*
+ * Watch the file and its directory, fall back to polling if that can't be done
+ */
+void follow_start(Follow* follow, const char* path, int fd) {
+  follow_open(follow, path, fd);
+
+#ifdef __linux__
+  int inotify = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+  if (inotify < 0) return;
+  if (!follow_watch(follow, inotify)) {
+    close(inotify);
+    follow->inotify = -1;
+  }
+#endif
+}
+
+#ifdef __linux__
+/*
+ * Read every pending event, return 1 if any of them is about our file
+ */
+static int follow_drain(Follow* follow) {
+  char buffer[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+  int relevant = 0;
+  ssize_t n;
+
+  while ((n = read(follow->inotify, buffer, sizeof(buffer))) > 0) {
+    for (char* p = buffer; p < buffer + n;) {
+      struct inotify_event* event = (struct inotify_event*) p;
+      if (event->wd == follow->file_watch || (event->len && strcmp(event->name, follow->name) == 0)) relevant = 1;
+      p += sizeof(struct inotify_event) + event->len;
+    }
+  }
+
+  return relevant;
+}
+#endif
+
+typedef enum {
+  FOLLOW_UNCHANGED,
+  // It is `size` bytes long now
+  FOLLOW_GREW,
+  // Truncated, or replaced by a new file under the same name. follow->fd is the one to read
+  FOLLOW_RELOAD,
+} Follow_Change;
+
+/*
+ * Look at what happened to the file: it can have grown, been truncated or been
+ * replaced by a new one under the same name. `known` is how much of it was read
+ */
+Follow_Change follow_look(Follow* follow, size_t known, size_t* size) {
+  struct stat st;
+
+  if (stat(follow->path, &st) == 0 && S_ISREG(st.st_mode) && (st.st_dev != follow->device || st.st_ino != follow->inode)) {
+    int fd = open(follow->path, O_RDONLY | O_CLOEXEC);
+    if (fd >= 0 && fstat(fd, &st) == 0) {
+      // The old mapping doesn't need the fd
+      close(follow->fd);
+      follow->fd = fd;
+      follow->device = st.st_dev;
+      follow->inode = st.st_ino;
+#ifdef __linux__
+      if (follow->inotify >= 0) {
+        inotify_rm_watch(follow->inotify, follow->file_watch);
+        follow->file_watch = inotify_add_watch(follow->inotify, follow->path, FOLLOW_FILE_EVENTS);
+      }
+#endif
+      return FOLLOW_RELOAD;
+    }
+    if (fd >= 0) close(fd);
+  }
+
+  if (fstat(follow->fd, &st) < 0) return FOLLOW_UNCHANGED;
+
+  *size = st.st_size;
+  if (*size < known) return FOLLOW_RELOAD;
+  if (*size > known) return FOLLOW_GREW;
+  return FOLLOW_UNCHANGED;
+}
+
+/*
+ * Whether the file is now smaller than the `known` bytes that are mapped. Reading those
+ * past its end would fault, it has to be reloaded before anything looks at them
+ */
+int follow_shrank(const Follow* follow, size_t known) {
+  struct stat st;
+  return fstat(follow->fd, &st) == 0 && (size_t) st.st_size < known;
+}
+
+/*
+ * Bring the view up to date with the file. Return 1 if it changed
+ */
+int follow_check(Follow* follow, Hui_List_Window* list_window) {
+  size_t size;
+
+  switch (follow_look(follow, list_window->lines.map_size, &size)) {
+    case FOLLOW_RELOAD:
+      hui_reload_list_window(list_window, follow->fd);
+      return 1;
+    case FOLLOW_GREW:
+      hui_file_grew_list_window(list_window, follow->fd, size);
+      return 1;
+    default:
+      return 0;
+  }
+}
+
+void follow_free(Follow* follow) {
+  if (!follow->active) return;
+  close(follow->fd);
+  if (follow->inotify >= 0) close(follow->inotify);
+}
+
+// ----------------------------------------------------
+// Merging files
+// ----------------------------------------------------
+// Several files in one view ordered by the timestamps of their lines. Each file is mapped
+// and indexed on its own, a heap holds the next line of each one and the smallest is copied
+// to the view, only as far as the view asks for. Lines without a timestamp, like the rest of
+// a stack trace, go with the line before them
+#define MERGE_TIME_SCAN 64
+#define MERGE_DAY (86400ull * 1000000)
+#define MERGE_TAG_MAX 24
+
+typedef struct {
+  Lines lines;
+  Follow follow;
+  // Next line of the file to merge, the time it goes at and whether it is in the heap
+  size_t next;
+  uint64_t time;
+  uint8_t queued;
+} Merge_Source;
+
+struct Merge {
+  uint8_t active;
+  Merge_Source* sources;
+  size_t count;
+  // Sources with a line ready, smallest (time, source) first
+  size_t* heap;
+  size_t heap_count;
+  // Files being written still get a last line without newline, it waits for the rest
+  uint8_t following;
+  // Every file and its directory are watched with this one, -1 when polling
+  int inotify;
+  struct timespec checked;
+  // A line is put together here: the name of its file then its text without escapes
+  char* text;
+  Hui_Attr_Run* runs;
+  size_t capacity;
+  size_t tag_width;
+};
+
+static int merge_digits(const char* p, const char* end, int n, uint64_t* value) {
+  if (end - p < n) return 0;
+  *value = 0;
+  for (int i = 0; i < n; i++) {
+    if (p[i] < '0' || p[i] > '9') return 0;
+    *value = *value * 10 + (p[i] - '0');
+  }
+  return 1;
+}
+
+/*
+ * hh:mm:ss with an optional fraction of a second, in microseconds. Return 0 if it isn't one
+ */
+static int merge_parse_clock(const char* p, const char* end, uint64_t* micros) {
+  uint64_t hours, minutes, seconds;
+  if (!merge_digits(p, end, 2, &hours) || end - p < 8 || p[2] != ':' || !merge_digits(p + 3, end, 2, &minutes) ||
+      p[5] != ':' || !merge_digits(p + 6, end, 2, &seconds)) return 0;
+
+  uint64_t fraction = 0;
+  int digits = 0;
+  p += 8;
+  if (p < end && (*p == '.' || *p == ',')) {
+    for (p++; p < end && *p >= '0' && *p <= '9'; p++) {
+      if (digits < 6) {
+        fraction = fraction * 10 + (*p - '0');
+        digits++;
+      }
+    }
+  }
+  for (; digits < 6; digits++) fraction *= 10;
+
+  *micros = ((hours * 60 + minutes) * 60 + seconds) * 1000000 + fraction;
+  return 1;
+}
+
+/*
+ * Find a timestamp near the start of the line: 2024-05-01T12:00:00.123, 2024/05/01 12:00:00,
+ * syslog's "May  1 12:00:00" or a bare 12:00:00. The time zone is ignored, and syslog's missing
+ * year only orders right against its own kind. Return 0 if there is none
+ */
+int merge_parse_time(const char* text, size_t count, uint64_t* time) {
+  static const char months[] = "JanFebMarAprMayJunJulAugSepOctNovDec";
+  const char* end = text + (count < MERGE_TIME_SCAN ? count : MERGE_TIME_SCAN);
+  int word_start = 1;
+
+  for (const char* p = text; p < end; p++) {
+    if (*p == '\x1b') {
+      size_t n = hui_escape_size(p, end - p);
+      if (n) p += n - 1;
+      word_start = 1;
+      continue;
+    }
+
+    int starts = word_start;
+    word_start = !((*p >= '0' && *p <= '9') || (*p >= 'a' && *p <= 'z') || (*p >= 'A' && *p <= 'Z'));
+    if (!starts) continue;
+
+    uint64_t year, month, day, micros;
+    if (merge_digits(p, end, 4, &year) && end - p > 11 && (p[4] == '-' || p[4] == '/') && merge_digits(p + 5, end, 2, &month) &&
+        p[7] == p[4] && merge_digits(p + 8, end, 2, &day) && (p[10] == 'T' || p[10] == ' ') && merge_parse_clock(p + 11, end, &micros)) {
+      *time = ((year * 12 + month - 1) * 31 + day - 1) * MERGE_DAY + micros;
+      return 1;
     }
-    while(expected_capacity >= lines->capacity) {
-      lines->capacity *= 2;
+
+    for (int i = 0; i < 12 && end - p > 4; i++) {
+      if (memcmp(p, months + 3 * i, 3) != 0 || p[3] != ' ') continue;
+      const char* q = p + 4;
+      if (*q == ' ') q++;
+      if (!merge_digits(q, end, 2, &day) && !merge_digits(q, end, 1, &day)) break;
+      q += day >= 10 || *q == '0' ? 2 : 1;
+      if (q < end && *q == ' ' && merge_parse_clock(q + 1, end, &micros)) {
+        *time = ((uint64_t) i * 31 + day - 1) * MERGE_DAY + micros;
+        return 1;
+      }
+      break;
     }
-    lines->lines = realloc(lines->lines, (lines->capacity * sizeof(Line)));
 
-    assert(lines->lines != NULL && "Out of memory");
+    if (merge_parse_clock(p, end, &micros)) {
+      *time = micros;
+      return 1;
+    }
   }
-}
 
-void push_line(Lines* lines, Line line) {
-  assert(line.count < 4096 && "Something went wrong here");
-  assert(line.line && "Line can't be empty");
-  line_reserve(lines, lines->count + 1);
-  lines->lines[lines->count++] = line;
+  return 0;
 }
 
-#define MAX_BUFFER_SIZE 4096
+static int merge_before(const Merge* merge, size_t a, size_t b) {
+  const Merge_Source* x = &merge->sources[a];
+  const Merge_Source* y = &merge->sources[b];
+  // Same time, the file named first goes first
+  return x->time < y->time || (x->time == y->time && a < b);
+}
 
-typedef struct {
-  size_t y;
-  size_t x;
-} Hui_List_Offset;
+static void merge_sift_down(Merge* merge, size_t at) {
+  while (1) {
+    size_t smallest = at;
+    size_t left = 2 * at + 1;
+    size_t right = left + 1;
+    if (left < merge->heap_count && merge_before(merge, merge->heap[left], merge->heap[smallest])) smallest = left;
+    if (right < merge->heap_count && merge_before(merge, merge->heap[right], merge->heap[smallest])) smallest = right;
+    if (smallest == at) return;
 
-typedef struct {
-  size_t width;
-  size_t height;
-  size_t x;
-  size_t y;
-  Lines lines;
-  Hui_List_Offset offset;
-  Line needle;
-  uint8_t following;
-} Hui_List_Window;
+    size_t swap = merge->heap[at];
+    merge->heap[at] = merge->heap[smallest];
+    merge->heap[smallest] = swap;
+    at = smallest;
+  }
+}
 
-Hui_List_Window hui_create_list_window(int width, int height, int y, int x) {
-  Hui_Window win = hui_create_window(width, height, y, x);
-  Line line = {
-    .line = 0,
-    .count = 0,
-  };
+static void merge_push(Merge* merge, size_t source) {
+  size_t at = merge->heap_count++;
+  merge->heap[at] = source;
+  merge->sources[source].queued = 1;
 
-  return (Hui_List_Window) {
-    .width = win.width,
-    .height = win.height,
-    .x = win.x,
-    .y = win.y,
-    .needle = line,
-  };
+  while (at > 0 && merge_before(merge, merge->heap[at], merge->heap[(at - 1) / 2])) {
+    size_t parent = (at - 1) / 2;
+    merge->heap[at] = merge->heap[parent];
+    merge->heap[parent] = source;
+    at = parent;
+  }
 }
 
-typedef struct {
-  char* cstr;
-  size_t size;
-} Sv;
+/*
+ * Index the next line of a source and find its time. Return 0 if it doesn't have one yet
+ */
+static int merge_source_ready(Merge* merge, Merge_Source* source) {
+  Lines* lines = &source->lines;
+  lines_index_until(lines, source->next + 1);
+  if (source->next >= lines->count) return 0;
 
-Sv sv_from_cstr(char* cstr, size_t size) {
-  return (Sv) {
-    .cstr = cstr,
-    .size = size,
-  };
+  size_t end = lines_offset(lines, source->next + 1);
+  if (merge->following && end == lines->map_size && lines->map[end - 1] != '\n') return 0;
+
+  Line line = lines_at(lines, source->next);
+  uint64_t time;
+  if (merge_parse_time(line.line, line.count, &time)) source->time = time;
+  return 1;
 }
 
-Sv sv_chop_by_size(Sv* sv, size_t size) {
-  if (size > sv->size) {
-    size = sv->size;
+/*
+ * Copy the next line of a source to the view, behind the name of its file.
+ * Return 0 if it was read from a file truncated under us, nothing is copied then
+ */
+static int merge_copy_line(Merge* merge, Lines* lines, size_t index, Line_Ref* ref) {
+  Merge_Source* source = &merge->sources[index];
+  Line line = lines_at(&source->lines, source->next);
+  if (line.count > LINE_SIZE_MAX - merge->tag_width - 1) line.count = LINE_SIZE_MAX - merge->tag_width - 1;
+
+  size_t size = merge->tag_width + 1 + line.count;
+  if (size > merge->capacity) {
+    merge->capacity = size;
+    merge->text = realloc(merge->text, merge->capacity);
+    merge->runs = realloc(merge->runs, (merge->capacity / 3 + 3) * sizeof(Hui_Attr_Run));
+    assert(merge->text && merge->runs && "Out of memory");
   }
 
-  Sv result = sv_from_cstr(sv->cstr, size);
+  size_t name = strlen(source->follow.name);
+  if (name > merge->tag_width) name = merge->tag_width;
+  memcpy(merge->text, source->follow.name, name);
+  memset(merge->text + name, ' ', merge->tag_width + 1 - name);
 
-  sv->cstr += size;
-  sv->size -= size;
+  // Each file gets its own colour, the line then starts in the default attributes
+  size_t tag = merge->tag_width + 1;
+  merge->runs[0] = (Hui_Attr_Run) { .start = 0, .attr = { .fg = HUI_COLOR_INDEXED(1 + index % 6) } };
+  merge->runs[1] = (Hui_Attr_Run) { .start = (uint32_t) tag };
 
-  return result;
+  Hui_Attr attr = {0};
+  size_t runs_count;
+  size_t count = hui_ansi_strip(line.line, line.count, &attr, merge->text + tag, merge->runs + 2, &runs_count);
+  for (size_t i = 0; i < runs_count; i++) merge->runs[2 + i].start += tag;
+  if (lines_map_truncated) return 0;
+
+  *ref = lines_append_line(lines, merge->text, tag + count, merge->runs, runs_count + 2);
+  return 1;
 }
 
-char *sv_strstr(Sv haystack, Sv needle) {
-    if (!needle.cstr) return (char *)haystack.cstr; // If needle is empty, return haystack
+/*
+ * Merge until the view has `count` lines or no file has one ready
+ */
+void merge_until(Merge* merge, Lines* lines, size_t count) {
+  while (lines->count < count && merge->heap_count) {
+    size_t index = merge->heap[0];
+    Merge_Source* source = &merge->sources[index];
+    Line_Ref ref;
+    // The file gets reloaded first, see handle_merge
+    if (!merge_copy_line(merge, lines, index, &ref)) return;
+    push_line(lines, ref);
+    source->next++;
 
-    for (size_t i = 0; i <= haystack.size - needle.size; i++) {
-        size_t j;
-        for (j = 0; j < needle.size; j++) {
-            if (haystack.cstr[i + j] != needle.cstr[j]) break;
-        }
-        if (j == needle.size) return (char *)&haystack.cstr[i];
+    if (!merge_source_ready(merge, source)) {
+      source->queued = 0;
+      merge->heap[0] = merge->heap[--merge->heap_count];
     }
-    return NULL; // needle not found
+    merge_sift_down(merge, 0);
+  }
 }
 
-void hui_draw_list_window(Hui_List_Window list_window) {
-  size_t height = list_window.height;
-  size_t x = list_window.x;
-  size_t y = list_window.y;
-  Hui_Window win = {
-    .width = list_window.width,
-    .height = list_window.height,
-    .x = list_window.x,
-    .y = list_window.y,
-  };
+int merge_is_done(const Merge* merge) {
+  return merge->heap_count == 0;
+}
 
-  size_t n = list_window.lines.count < height ? list_window.lines.count : height;
+/*
+ * Open another file to merge, return 0 if it can't be opened or mapped
+ */
+int merge_add(Merge* merge, const char* path) {
+  int fd = open(path, O_RDONLY | O_CLOEXEC);
+  if (fd < 0) return 0;
 
-  for (size_t i = 0; i < n; i++) {
-    uint64_t offset_y = i + list_window.offset.y;
-    uint64_t offset_x = list_window.offset.x;
+  merge->sources = realloc(merge->sources, (merge->count + 1) * sizeof(Merge_Source));
+  assert(merge->sources && "Out of memory");
+  Merge_Source* source = &merge->sources[merge->count];
+  *source = (Merge_Source) {0};
 
-    if (offset_y >= list_window.lines.count) break;
+  if (!lines_map_file(&source->lines, fd)) {
+    close(fd);
+    errno = EINVAL;
+    return 0;
+  }
+  follow_open(&source->follow, path, fd);
+  merge->count++;
+  return 1;
+}
 
-    Line line = list_window.lines.lines[offset_y];
-    
-    Sv sv_line;
-    if (offset_x > line.count) {
-      sv_line = sv_from_cstr("", 0);
-    } else {
-      uint64_t real_offset = line.count - offset_x > list_window.width ? list_window.width : line.count - offset_x;
-      sv_line = sv_from_cstr(line.line + offset_x, real_offset);
-    }
+/*
+ * Start merging into `lines`. The files are watched for new lines from now on
+ */
+void merge_start(Merge* merge, Lines* lines, uint8_t following) {
+  merge->active = 1;
+  merge->following = following;
+  merge->heap = malloc(merge->count * sizeof(size_t));
+  assert(merge->heap && "Out of memory");
+  lines->merge = merge;
 
-    size_t acc = 0;
+  for (size_t i = 0; i < merge->count; i++) {
+    size_t name = strlen(merge->sources[i].follow.name);
+    if (name > merge->tag_width) merge->tag_width = name < MERGE_TAG_MAX ? name : MERGE_TAG_MAX;
+    if (merge_source_ready(merge, &merge->sources[i])) merge_push(merge, i);
+  }
 
-    if (!line.count) continue;
+  clock_gettime(CLOCK_MONOTONIC, &merge->checked);
+  merge->inotify = -1;
+#ifdef __linux__
+  int inotify = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+  if (inotify < 0) return;
+  for (size_t i = 0; i < merge->count; i++) {
+    if (follow_watch(&merge->sources[i].follow, inotify)) continue;
+    // All of them are polled then
+    for (size_t j = 0; j < merge->count; j++) merge->sources[j].follow.inotify = -1;
+    close(inotify);
+    return;
+  }
+  merge->inotify = inotify;
+#endif
+}
 
-    if (list_window.needle.line) {
-      Sv needle = sv_from_cstr(list_window.needle.line, strlen(list_window.needle.line));
+/*
+ * Look at every file for new lines, lines already merged stay where they are.
+ * Return 1 if any file changed
+ */
+int merge_check(Merge* merge) {
+  int changed = 0;
 
-      char* substring = sv_strstr(sv_line, needle);
-      while (substring) {
-        size_t substring_size = substring - sv_line.cstr;
-        Sv sv1 = sv_chop_by_size(&sv_line, substring_size);
-        hui_put_text_at_window(win, sv1.cstr, sv1.size, i + y, x + acc);
+  for (size_t i = 0; i < merge->count; i++) {
+    Merge_Source* source = &merge->sources[i];
+    size_t size;
 
-        acc = acc + substring_size;
+    switch (follow_look(&source->follow, source->lines.map_size, &size)) {
+      case FOLLOW_RELOAD:
+        lines_free(&source->lines);
+        source->lines = (Lines) {0};
+        lines_map_file(&source->lines, source->follow.fd);
+        source->next = 0;
+        break;
+      case FOLLOW_GREW:
+        lines_file_grew(&source->lines, source->follow.fd, size);
+        break;
+      default:
+        continue;
+    }
 
-        Sv sv_needle = sv_chop_by_size(&sv_line, needle.size);
+    changed = 1;
+  }
 
-        Sv blue_fg = sv_from_cstr("\x1b[34m", 5);
-        hui_put_text_at_window(win, blue_fg.cstr, blue_fg.size, i + y, x + acc);
-        hui_put_text_at_window(win, sv_needle.cstr, sv_needle.size, i + y, x + acc);
-        Sv reset_fg = sv_from_cstr("\x1b[m", 3);
-        hui_put_text_at_window(win, reset_fg.cstr, reset_fg.size, i + y, x + acc);
-        acc = acc + sv_needle.size;
+  if (!changed) return 0;
 
-        char* result = sv_strstr(sv_line, needle);
-        
-        // TODO find a better way to solve this; Sometimes the strstr return the same as before, this is likely an logic error above
-        if (result == substring) break;
+  // A file that was truncated, replaced or lost its unterminated last line may not have
+  // the line it had queued anymore, so every file is looked at again
+  merge->heap_count = 0;
+  for (size_t i = 0; i < merge->count; i++) {
+    merge->sources[i].queued = 0;
+    if (merge_source_ready(merge, &merge->sources[i])) merge_push(merge, i);
+  }
+  return 1;
+}
 
-        substring = result;
-      }
+void merge_free(Merge* merge) {
+  if (!merge->active) return;
+  for (size_t i = 0; i < merge->count; i++) {
+    lines_free(&merge->sources[i].lines);
+    close(merge->sources[i].follow.fd);
+  }
+  if (merge->inotify >= 0) close(merge->inotify);
+  free(merge->sources);
+  free(merge->heap);
+  free(merge->text);
+  free(merge->runs);
+}
 
-    }
+// ----------------------------------------------------
+// Delimiter scanning, the hot part of the ingest loop
+// ----------------------------------------------------
+// Looks for the bytes the ingest loop cares about: '\n', '\t', '\r' and ESC
+// Returns `end` when there is none
+typedef const char* (*Scan_Delimiters)(const char* p, const char* end);
 
-    if (sv_line.cstr) hui_put_text_at_window(win, sv_line.cstr, sv_line.size, i + y, x + acc);
+static const char* scan_delimiters_scalar(const char* p, const char* end) {
+  for (; p < end; p++) {
+    if (*p == '\n' || *p == '\t' || *p == '\r' || *p == '\x1b') return p;
   }
+  return end;
 }
 
-void hui_free_list_window(Hui_List_Window list_window) {
-  for (size_t i = 0; i < list_window.lines.count; i++) {
-    free(list_window.lines.lines[i].line);
+#if defined(__x86_64__) || defined(__i386__)
+__attribute__((target("sse2")))
+static const char* scan_delimiters_sse2(const char* p, const char* end) {
+  const __m128i nl = _mm_set1_epi8('\n');
+  const __m128i tab = _mm_set1_epi8('\t');
+  const __m128i cr = _mm_set1_epi8('\r');
+  const __m128i esc = _mm_set1_epi8('\x1b');
+
+  while (end - p >= 16) {
+    __m128i v = _mm_loadu_si128((const __m128i*) p);
+    __m128i hits = _mm_or_si128(_mm_or_si128(_mm_cmpeq_epi8(v, nl), _mm_cmpeq_epi8(v, tab)),
+                                _mm_or_si128(_mm_cmpeq_epi8(v, cr), _mm_cmpeq_epi8(v, esc)));
+    uint32_t mask = (uint32_t) _mm_movemask_epi8(hits);
+    if (mask) return p + __builtin_ctz(mask);
+    p += 16;
   }
-  free(list_window.lines.lines);
+
+  return scan_delimiters_scalar(p, end);
 }
 
-void hui_go_up_list_window(Hui_List_Window* list_window) {
-  if (list_window->offset.y > 0) list_window->offset.y--;
+__attribute__((target("avx2")))
+static const char* scan_delimiters_avx2(const char* p, const char* end) {
+  const __m256i nl = _mm256_set1_epi8('\n');
+  const __m256i tab = _mm256_set1_epi8('\t');
+  const __m256i cr = _mm256_set1_epi8('\r');
+  const __m256i esc = _mm256_set1_epi8('\x1b');
+
+  while (end - p >= 32) {
+    __m256i v = _mm256_loadu_si256((const __m256i*) p);
+    __m256i hits = _mm256_or_si256(_mm256_or_si256(_mm256_cmpeq_epi8(v, nl), _mm256_cmpeq_epi8(v, tab)),
+                                   _mm256_or_si256(_mm256_cmpeq_epi8(v, cr), _mm256_cmpeq_epi8(v, esc)));
+    uint32_t mask = (uint32_t) _mm256_movemask_epi8(hits);
+    if (mask) return p + __builtin_ctz(mask);
+    p += 32;
+  }
+
+  return scan_delimiters_sse2(p, end);
 }
+#endif
 
-void hui_page_up_list_window(Hui_List_Window* list_window) {
-  for (size_t i = 0; i < list_window->height; i++) {
-    hui_go_up_list_window(list_window);
+/*
+ * Pick the widest kernel the cpu supports, only done once
+ */
+const char* scan_delimiters(const char* p, const char* end) {
+  static Scan_Delimiters kernel = NULL;
+
+  if (!kernel) {
+    kernel = scan_delimiters_scalar;
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("sse2")) kernel = scan_delimiters_sse2;
+    if (__builtin_cpu_supports("avx2")) kernel = scan_delimiters_avx2;
+#endif
   }
+
+  return kernel(p, end);
 }
 
-void hui_go_down_list_window(Hui_List_Window* list_window) {
-  size_t n = list_window->lines.count;
-  size_t cursor = list_window->offset.y;
-  size_t height = list_window->height;
+// ----------------------------------------------------
+// Ingest thread
+// ----------------------------------------------------
+// Piped input is read and split into lines on its own thread, finished lines are
+// handed to the UI thread in batches through a single producer, single consumer ring.
+// An fd in the poll set wakes the UI when there are batches, so a flood on the pipe
+// never sits between a keystroke and its frame
+
+// Reads start at what a pipe holds by default and double while they come back full
+#define READ_SIZE_MIN (64 << 10)
+#define READ_SIZE_MAX (1 << 20)
+// A batch is handed over once it is this big, or earlier when the pipe is empty
+#define INGEST_BATCH_SIZE (1 << 20)
+#define INGEST_QUEUE_SIZE 64
+// Most the UI thread takes from the queue in one wakeup, the keyboard is looked at in between
+#define INGEST_TAKE_BUDGET (8 << 20)
+
+typedef struct {
+  // Complete lines back to back, tabs and carriage returns already blanked, escapes removed.
+  // The start of the next line may follow them, that is `pending` bytes
+  char* data;
+  size_t size;
+  size_t pending;
+  size_t capacity;
+  size_t* counts;
+  size_t count;
+  size_t counts_capacity;
+  // What the SGRs left of the escapes, runs_counts[i] runs for line i, then those of the pending line
+  Hui_Attr_Run* runs;
+  size_t* runs_counts;
+  size_t runs_size;
+  size_t pending_runs;
+  size_t runs_capacity;
+  // Set on the last batch, the input ended
+  uint8_t eof;
+  // The input went idle in the middle of a line, the pending one is shown until it ends
+  uint8_t partial;
+} Ingest_Batch;
 
-  if (n < height) return;
+typedef struct {
+  int fd;
+  // Spilled input is handed over as it was read, the spill file is split by the indexing
+  uint8_t raw;
+  // Attributes set by the escapes so far, they carry over to the next line
+  Hui_Attr attr;
+  pthread_t thread;
+  // Only the ingest thread moves head, only the UI thread moves tail
+  Ingest_Batch* queue[INGEST_QUEUE_SIZE];
+  atomic_size_t head;
+  atomic_size_t tail;
+  // Set while the ingest thread waits for room, the UI then signals space
+  atomic_int waiting;
+  // Readable when there are batches, and when a full queue got room
+  int ready[2];
+  int space[2];
+  uint8_t running;
+  // The last line came from a partial batch, the next batch has it whole. Only the UI thread uses it
+  uint8_t partial;
+} Ingest;
 
-  if (n > height && cursor > n - height) {
-    return ;
+/*
+ * An fd to wake a poll with: an eventfd, or a pipe where there is none. [0] is polled, [1] signaled
+ */
+static int wakeup_open(int wakeup[2]) {
+#ifdef __linux__
+  wakeup[0] = wakeup[1] = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+  return wakeup[0] >= 0;
+#else
+  if (pipe(wakeup) < 0) return 0;
+  for (int i = 0; i < 2; i++) {
+    fcntl(wakeup[i], F_SETFL, fcntl(wakeup[i], F_GETFL) | O_NONBLOCK);
+    fcntl(wakeup[i], F_SETFD, FD_CLOEXEC);
   }
+  return 1;
+#endif
+}
 
-  if (n > 0 && cursor < n -1) list_window->offset.y++;
+static void wakeup_signal(int wakeup[2]) {
+  uint64_t one = 1;
+  // A full pipe is already readable, nothing is lost
+  while (write(wakeup[1], &one, sizeof(one)) < 0 && errno == EINTR);
 }
 
-void hui_page_down_list_window(Hui_List_Window* list_window) {
-  for (size_t i = 0; i < list_window->height; i++) {
-    hui_go_down_list_window(list_window);
-  }
+static void wakeup_clear(int wakeup[2]) {
+  uint64_t buffer[8];
+  ssize_t n;
+  do {
+    n = read(wakeup[0], buffer, sizeof(buffer));
+  } while (n > 0 || (n < 0 && errno == EINTR));
 }
 
-void hui_end_list_window(Hui_List_Window* list_window) {
-  if (list_window->lines.count > list_window->height) {
-    list_window->offset.y = list_window->lines.count - list_window->height;
-  } else {
-    list_window->offset.y = 0;
-  }
+static void wakeup_close(int wakeup[2]) {
+  close(wakeup[0]);
+  if (wakeup[1] != wakeup[0]) close(wakeup[1]);
 }
 
-void hui_go_left_list_window(Hui_List_Window* list_window) {
-  if (list_window->offset.x > 0) list_window->offset.x--;
+/*
+ * Make the data fd non-blocking so each wakeup can drain it, and ask for a bigger pipe.
+ * Users can't go past /proc/sys/fs/pipe-max-size, whatever we get is fine
+ */
+void ingest_prepare(int fd) {
+  int flags = fcntl(fd, F_GETFL);
+  if (flags >= 0) fcntl(fd, F_SETFL, flags | O_NONBLOCK);
+#ifdef F_SETPIPE_SZ
+  struct stat st;
+  if (fstat(fd, &st) == 0 && S_ISFIFO(st.st_mode)) fcntl(fd, F_SETPIPE_SZ, READ_SIZE_MAX);
+#endif
 }
 
-void hui_go_right_list_window(Hui_List_Window* list_window) {
-  list_window->offset.x++;
+static Ingest_Batch* ingest_batch_new() {
+  Ingest_Batch* batch = calloc(1, sizeof(Ingest_Batch));
+  assert(batch && "Out of memory");
+  return batch;
 }
 
-void hui_push_line_list_window(Hui_List_Window* list_window, Line line) {
-  push_line(&list_window->lines, line);
-  
-  size_t n = list_window->lines.count;
+static void ingest_batch_free(Ingest_Batch* batch) {
+  free(batch->data);
+  free(batch->counts);
+  free(batch->runs);
+  free(batch->runs_counts);
+  free(batch);
+}
 
-  if (n > list_window->height && list_window->following) hui_end_list_window(list_window);
-;
+static void ingest_batch_reserve(Ingest_Batch* batch, size_t size) {
+  size_t expected_capacity = batch->size + batch->pending + size;
+  if (expected_capacity <= batch->capacity) return;
 
- 
+  size_t capacity = batch->capacity ? batch->capacity : READ_SIZE_MIN;
+  while (capacity < expected_capacity) capacity *= 2;
+  batch->data = realloc(batch->data, capacity);
+  assert(batch->data && "Out of memory");
+  batch->capacity = capacity;
 }
 
-void hui_home_list_window(Hui_List_Window* list_window) {
-  list_window->offset.y = 0;
+/*
+ * From the current position of the pending line on, text is drawn with `attr`
+ */
+static void ingest_batch_add_run(Ingest_Batch* batch, Hui_Attr attr) {
+  Hui_Attr_Run* last = batch->pending_runs ? &batch->runs[batch->runs_size + batch->pending_runs - 1] : NULL;
+  if (last && last->start == batch->pending) {
+    last->attr = attr;
+    return;
+  }
+
+  if (batch->runs_size + batch->pending_runs >= batch->runs_capacity) {
+    batch->runs_capacity = batch->runs_capacity ? batch->runs_capacity * 2 : 256;
+    batch->runs = realloc(batch->runs, batch->runs_capacity * sizeof(Hui_Attr_Run));
+    assert(batch->runs && "Out of memory");
+  }
+  batch->runs[batch->runs_size + batch->pending_runs++] = (Hui_Attr_Run) { .start = (uint32_t) batch->pending, .attr = attr };
 }
 
-int hui_go_to_next_occurrence(Hui_List_Window* list_window) {
-  if (!list_window->needle.line && list_window->needle.count == 0) return 0;
+/*
+ * The pending bytes are a line, the attributes still set carry over to the next one
+ */
+static void ingest_batch_end_line(Ingest_Batch* batch, Hui_Attr attr) {
+  if (batch->count >= batch->counts_capacity) {
+    batch->counts_capacity = batch->counts_capacity ? batch->counts_capacity * 2 : 1024;
+    batch->counts = realloc(batch->counts, batch->counts_capacity * sizeof(size_t));
+    batch->runs_counts = realloc(batch->runs_counts, batch->counts_capacity * sizeof(size_t));
+    assert(batch->counts && batch->runs_counts && "Out of memory");
+  }
+  batch->runs_counts[batch->count] = batch->pending_runs;
+  batch->counts[batch->count++] = batch->pending;
+  batch->size += batch->pending;
+  batch->pending = 0;
+  batch->runs_size += batch->pending_runs;
+  batch->pending_runs = 0;
 
-  for (size_t i = list_window->offset.y + 1; i < list_window->lines.count; i++) {
-    if (strstr(list_window->lines.lines[i].line, list_window->needle.line)) {
-     list_window->offset.y = i;
-     return 1;
+  if (!hui_attr_equal(attr, (Hui_Attr) {0})) ingest_batch_add_run(batch, attr);
+}
+
+/*
+ * Split what was read into the lines of the batch, SGRs become attribute runs.
+ * Return how much was used, an escape cut by the end of the read waits for the next one
+ */
+static size_t ingest_split(Ingest* ingest, Ingest_Batch* batch, const char* buffer, size_t bytes) {
+  // Every byte read ends up in the batch, there is always room for all of them
+  ingest_batch_reserve(batch, bytes);
+  const char* p = buffer;
+  const char* end = buffer + bytes;
+
+  while (p < end) {
+    const char* delimiter = scan_delimiters(p, end);
+
+    // Lines are kept whole up to LINE_SIZE_MAX, a batch is only published once one ends
+    size_t plain = delimiter - p;
+    if (plain > LINE_SIZE_MAX - batch->pending) plain = LINE_SIZE_MAX - batch->pending;
+    memcpy(batch->data + batch->size + batch->pending, p, plain);
+    batch->pending += plain;
+    p += plain;
+
+    // A full line goes on in the next one, unless only its newline or escapes are left
+    if (batch->pending == LINE_SIZE_MAX && p < end && *p != '\n' && *p != '\x1b') {
+      ingest_batch_end_line(batch, ingest->attr);
+      continue;
+    }
+    if (p == end) break;
+
+    if (*p == '\x1b') {
+      size_t n = hui_escape_size(p, end - p);
+      if (!n) break;
+      if (n >= 3 && p[1] == '[' && p[n - 1] == 'm') {
+        hui_sgr_apply(&ingest->attr, p + 2, n - 3);
+        ingest_batch_add_run(batch, ingest->attr);
+      }
+      p += n;
+      continue;
     }
+
+    if (*p == '\n') {
+      ingest_batch_end_line(batch, ingest->attr);
+    } else {
+      // Tabs and carriage returns
+      batch->data[batch->size + batch->pending++] = ' ';
+    }
+    p++;
   }
 
-  return 0;
+  return p - buffer;
 }
 
-int hui_go_to_previous_occurrence(Hui_List_Window* list_window) {
-  if (!list_window->needle.line && list_window->needle.count == 0) return 0;
+/*
+ * Hand a batch to the UI thread, waiting while the queue is full.
+ * Return the batch to fill next, it starts with the pending bytes. They stay in `batch` too,
+ * a partial one shows them
+ */
+static Ingest_Batch* ingest_publish(Ingest* ingest, Ingest_Batch* batch) {
+  Ingest_Batch* next = ingest_batch_new();
+  if (batch->pending) {
+    ingest_batch_reserve(next, batch->pending);
+    memcpy(next->data, batch->data + batch->size, batch->pending);
+    next->pending = batch->pending;
+  }
+  if (batch->pending_runs) {
+    next->runs_capacity = batch->pending_runs;
+    next->runs = malloc(next->runs_capacity * sizeof(Hui_Attr_Run));
+    assert(next->runs && "Out of memory");
+    memcpy(next->runs, batch->runs + batch->runs_size, batch->pending_runs * sizeof(Hui_Attr_Run));
+    next->pending_runs = batch->pending_runs;
+  }
 
-  if (list_window->offset.y == 0) {
-    return 0;
+  size_t head = atomic_load_explicit(&ingest->head, memory_order_relaxed);
+  while (head - atomic_load_explicit(&ingest->tail, memory_order_acquire) == INGEST_QUEUE_SIZE) {
+    // Checked again after saying we wait, so the UI either sees the flag or we see its room
+    atomic_store(&ingest->waiting, 1);
+    if (head - atomic_load(&ingest->tail) == INGEST_QUEUE_SIZE) {
+      struct pollfd space = { .fd = ingest->space[0], .events = POLLIN };
+      poll(&space, 1, -1);
+      wakeup_clear(ingest->space);
+    }
+    atomic_store(&ingest->waiting, 0);
   }
 
-  size_t i = list_window->offset.y - 1;
+  ingest->queue[head & (INGEST_QUEUE_SIZE - 1)] = batch;
+  atomic_store_explicit(&ingest->head, head + 1, memory_order_release);
+  wakeup_signal(ingest->ready);
+  return next;
+}
+
+static void* ingest_worker(void* arg) {
+  Ingest* ingest = arg;
+  // Room for the start of an escape left from the last read
+  char* buffer = malloc(READ_SIZE_MAX + HUI_ESCAPE_MAX);
+  assert(buffer && "Out of memory");
+  size_t read_size = READ_SIZE_MIN;
+  size_t carry = 0;
+  Ingest_Batch* batch = ingest_batch_new();
 
   while (1) {
-    if (strstr(list_window->lines.lines[i].line, list_window->needle.line)) {
-     list_window->offset.y = i;
-     return 1;
+    ssize_t bytes = read(ingest->fd, buffer + carry, read_size);
+    if (bytes < 0 && errno == EINTR) continue;
+
+    if (bytes < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+      // Caught up, hand over what there is and sleep until the writer has more. A line
+      // without its newline yet is shown too, the UI replaces it when the rest comes
+      batch->partial = batch->pending > 0;
+      if (batch->count || batch->partial || (ingest->raw && batch->size)) batch = ingest_publish(ingest, batch);
+      struct pollfd data = { .fd = ingest->fd, .events = POLLIN };
+      poll(&data, 1, -1);
+      continue;
     }
 
-    // We can't allow it to overflow, but we must include 0
-    if (i == 0) return 0;
+    // End of the input, or an error that won't go away
+    if (bytes <= 0) break;
 
-    i--;
+    if (ingest->raw) {
+      ingest_batch_reserve(batch, bytes);
+      memcpy(batch->data + batch->size, buffer, bytes);
+      batch->size += bytes;
+    } else {
+      size_t available = carry + bytes;
+      size_t used = ingest_split(ingest, batch, buffer, available);
+      carry = available - used;
+      memmove(buffer, buffer + used, carry);
+    }
+    if (batch->size >= INGEST_BATCH_SIZE) batch = ingest_publish(ingest, batch);
+
+    // A full read means the writer is ahead of us, a short one that we caught up
+    if ((size_t) bytes == read_size && read_size < READ_SIZE_MAX) read_size *= 2;
+    else if ((size_t) bytes < read_size / 4 && read_size > READ_SIZE_MIN) read_size /= 2;
   }
 
-  return 0;
+  // An escape cut by the end of the input never completes, it is kept as text
+  if (carry) {
+    if (batch->pending + carry > LINE_SIZE_MAX) ingest_batch_end_line(batch, ingest->attr);
+    ingest_batch_reserve(batch, carry);
+    memcpy(batch->data + batch->size + batch->pending, buffer, carry);
+    batch->pending += carry;
+  }
+
+  // The last line counts even without a newline
+  if (batch->pending) ingest_batch_end_line(batch, ingest->attr);
+  batch->eof = 1;
+  ingest_batch_free(ingest_publish(ingest, batch));
+  free(buffer);
+  return NULL;
+}
+
+/*
+ * Start reading `fd` on the ingest thread. Return 0 if it couldn't be started
+ */
+int ingest_start(Ingest* ingest, int fd, uint8_t raw) {
+  ingest->fd = fd;
+  ingest->raw = raw;
+  ingest->partial = 0;
+  ingest_prepare(fd);
+  if (!wakeup_open(ingest->ready)) return 0;
+  if (!wakeup_open(ingest->space)) {
+    wakeup_close(ingest->ready);
+    return 0;
+  }
+
+  // Signals like SIGWINCH must keep landing on the UI thread
+  sigset_t all, previous;
+  sigfillset(&all);
+  pthread_sigmask(SIG_BLOCK, &all, &previous);
+  ingest->running = pthread_create(&ingest->thread, NULL, ingest_worker, ingest) == 0;
+  pthread_sigmask(SIG_SETMASK, &previous, NULL);
+
+  if (!ingest->running) {
+    wakeup_close(ingest->ready);
+    wakeup_close(ingest->space);
+  }
+  return ingest->running;
+}
+
+/*
+ * Return 1 if there are batches the UI thread didn't take yet
+ */
+int ingest_has_batches(Ingest* ingest) {
+  return ingest->running &&
+         atomic_load_explicit(&ingest->head, memory_order_acquire) != atomic_load_explicit(&ingest->tail, memory_order_relaxed);
 }
 
+typedef enum {
+  PROMPT_SEARCH,
+  PROMPT_FILTER,
+  PROMPT_JUMP,
+} Tailess_Prompt;
+
 typedef struct {
   struct pollfd fd[2];
   Hui_Window window;
@@ -291,51 +4044,169 @@ typedef struct {
   Hui_Input input_window;
   Hui_Window message_window;
   uint8_t numberFds;
+  uint8_t regex;
+  Tailess_Prompt prompt;
+  // Digits typed before a command, as in 50% or 1200G
+  size_t count;
+  uint8_t counting;
+  // Regular files, fd[1] is then the inotify fd if there is one
+  Follow follow;
+  // Piped input, fd[1] is then its wakeup fd
+  Ingest ingest;
+  // Several files, fd[1] is then the inotify fd they share if there is one
+  Merge merge;
 } Tailess_Context;
 
+void tailess_set_prompt(Tailess_Context* context, Tailess_Prompt prompt) {
+  context->prompt = prompt;
+  if (prompt == PROMPT_FILTER) {
+    context->input_window.prompt = context->regex ? "regex&" : "&";
+  } else if (prompt == PROMPT_JUMP) {
+    context->input_window.prompt = ":";
+  } else {
+    context->input_window.prompt = context->regex ? "regex/" : "/";
+  }
+}
+
+/*
+ * Jump to "N", a line number counting from 1, or "N%" of the way through the input
+ */
+void tailess_jump(Tailess_Context* context, const char* text, size_t size) {
+  size_t value = 0;
+  size_t i = 0;
+  for (; i < size && text[i] >= '0' && text[i] <= '9'; i++) {
+    value = value > SIZE_MAX / 10 ? SIZE_MAX : value * 10 + (text[i] - '0');
+  }
+  if (i == 0) return;
+
+  context->list_window.following = 0;
+  if (i == size) {
+    hui_go_to_line_list_window(&context->list_window, value > 0 ? value - 1 : 0);
+  } else if (i + 1 == size && text[i] == '%') {
+    hui_go_to_percent_list_window(&context->list_window, value);
+  }
+}
+
+/*
+ * Changes of a followed file, on inotify events or once in a while when polling
+ */
+uint8_t handle_follow(Tailess_Context* context) {
+  Follow* follow = &context->follow;
+  if (!follow->active) return 0;
+
+  if (lines_map_truncated || follow_shrank(follow, context->list_window.lines.map_size)) {
+    // It shrank and the event may not be there yet
+    lines_map_truncated = 0;
+  } else if (follow->inotify >= 0) {
+#ifdef __linux__
+    if (!(context->fd[1].revents & POLLIN) || !follow_drain(follow)) return 0;
+#endif
+  } else {
+    if (elapsed_ms(&follow->checked) < FOLLOW_POLL_INTERVAL_MS) return 0;
+    clock_gettime(CLOCK_MONOTONIC, &follow->checked);
+  }
+
+  return follow_check(follow, &context->list_window);
+}
+
+/*
+ * New lines in the merged files, on inotify events or once in a while when polling
+ */
+uint8_t handle_merge(Tailess_Context* context) {
+  Merge* merge = &context->merge;
+  if (!merge->active) return 0;
+
+  int shrank = 0;
+  for (size_t i = 0; i < merge->count && !shrank; i++) {
+    shrank = follow_shrank(&merge->sources[i].follow, merge->sources[i].lines.map_size);
+  }
+
+  if (lines_map_truncated || shrank) {
+    lines_map_truncated = 0;
+  } else if (merge->inotify >= 0) {
+#ifdef __linux__
+    if (!(context->fd[1].revents & POLLIN)) return 0;
+    // Any of the files could be behind an event, they are all looked at
+    char buffer[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+    while (read(merge->inotify, buffer, sizeof(buffer)) > 0);
+#endif
+  } else {
+    if (elapsed_ms(&merge->checked) < FOLLOW_POLL_INTERVAL_MS) return 0;
+    clock_gettime(CLOCK_MONOTONIC, &merge->checked);
+  }
+
+  if (!merge_check(merge)) return 0;
+  if (context->list_window.following) hui_end_list_window(&context->list_window);
+  return 1;
+}
+
+/*
+ * The input ended and the thread is gone, whatever was read stays
+ */
+static void ingest_close(Tailess_Context* context) {
+  Ingest* ingest = &context->ingest;
+  pthread_join(ingest->thread, NULL);
+  ingest->running = 0;
+  wakeup_close(ingest->ready);
+  wakeup_close(ingest->space);
+  context->numberFds--;
+  if (context->list_window.lines.spilling) lines_spill_close(&context->list_window.lines);
+}
+
+/*
+ * Copy the lines of a batch into the chunks. Return 1 if there were any
+ */
+static uint8_t ingest_take_batch(Tailess_Context* context, Ingest_Batch* batch) {
+  Lines* lines = &context->list_window.lines;
+
+  if (context->ingest.raw) {
+    if (!batch->size) return 0;
+    // The new lines are found by the indexing, like with a file
+    lines_spill_append(lines, batch->data, batch->size);
+    if (context->list_window.following) hui_end_list_window(&context->list_window);
+    return 1;
+  }
+
+  // The line shown before it ended starts this batch again
+  if (context->ingest.partial) hui_pop_line_list_window(&context->list_window);
+  context->ingest.partial = batch->partial;
+
+  const char* line = batch->data;
+  const Hui_Attr_Run* runs = batch->runs;
+  for (size_t i = 0; i < batch->count; i++) {
+    hui_push_line_list_window(&context->list_window, lines_append_line(lines, line, batch->counts[i], runs, batch->runs_counts[i]));
+    line += batch->counts[i];
+    runs += batch->runs_counts[i];
+  }
+  if (batch->partial) hui_push_line_list_window(&context->list_window, lines_append_line(lines, line, batch->pending, runs, batch->pending_runs));
+  return batch->count > 0 || batch->partial;
+}
+
 uint8_t handle_read_data(Tailess_Context* context)
 {
-  static char buffer[MAX_BUFFER_SIZE];
-  static char buffer2[MAX_BUFFER_SIZE];
-  static size_t b2_size = 0;
+  Ingest* ingest = &context->ingest;
   uint8_t updated = 0;
 
-  if (context->numberFds > 1) {
-    if (context->fd[1].revents & POLLIN) {
-      ssize_t bytes = read(context->fd[1].fd, buffer, MAX_BUFFER_SIZE);
-      if (bytes > 0) {
-        for (int i = 0; i < bytes; i++) {
-          if (buffer[i] == '\n') {
-            Line line = {0};
-            line.count = b2_size;
-            line.line = malloc(sizeof(char) * line.count + 1);
-            strncpy(line.line, buffer2, line.count);
-            line.line[line.count] = '\0';
-            b2_size = 0;
-            hui_push_line_list_window(&context->list_window, line);
-            updated = 1;
-          } else if (buffer[i] == '\t' || buffer[i] == '\r') {
-            buffer2[b2_size++] = ' ';
-          } else {
-            if (b2_size >= MAX_BUFFER_SIZE - 1) {
-              Line line = {0};
-              line.count = b2_size;
-              line.line = malloc(sizeof(char) * line.count + 1);
-              strncpy(line.line, buffer2, line.count);
-              line.line[line.count] = '\0';
-              b2_size = 0;
-              hui_push_line_list_window(&context->list_window, line);
-              updated = 1;
-            }
-            buffer2[b2_size++] = buffer[i];
-          }
-        }
-      } else if (bytes == 0) {
-        //Something is weird, we got a POLLIN event but there was nothing to read??
-        context->numberFds--;
-      }
-    } else if (context->fd[1].revents & POLLERR || context->fd[1].revents & POLLNVAL|| context->fd[1].revents & POLLHUP) {
-      context->numberFds--;
+  if (context->numberFds < 2 || !ingest->running) return 0;
+
+  if (context->fd[1].revents & POLLIN) wakeup_clear(ingest->ready);
+
+  // What is left over is taken on the next turn, poll doesn't sleep while there is some
+  size_t taken = 0;
+  while (taken < INGEST_TAKE_BUDGET && ingest_has_batches(ingest)) {
+    size_t tail = atomic_load_explicit(&ingest->tail, memory_order_relaxed);
+    Ingest_Batch* batch = ingest->queue[tail & (INGEST_QUEUE_SIZE - 1)];
+    atomic_store(&ingest->tail, tail + 1);
+    if (atomic_load(&ingest->waiting)) wakeup_signal(ingest->space);
+
+    updated |= ingest_take_batch(context, batch);
+    taken += batch->size;
+    uint8_t eof = batch->eof;
+    ingest_batch_free(batch);
+
+    if (eof) {
+      ingest_close(context);
+      return 1;
     }
   }
 
@@ -356,6 +4227,11 @@ uint8_t handle_hui_events(Tailess_Context* context) {
     context->input_window.height = 1;
     context->input_window.y = context->window.height - 1;
     context->input_window.x = 0;
+
+    context->message_window.width = context->window.width;
+    context->message_window.height = 1;
+    context->message_window.y = context->window.height - 2;
+    context->message_window.x = 0;
     return 1;
   }
 
@@ -369,9 +4245,18 @@ uint8_t handle_input(Tailess_Context* context) {
   if (fd[0].revents & POLLIN) {
     read(fd[0].fd, &ch, 1);
 
+    if (!context->input_window.focus && ch >= '0' && ch <= '9') {
+      context->count = context->counting ? context->count * 10 + (ch - '0') : (size_t) (ch - '0');
+      context->counting = 1;
+      return 0;
+    }
+    uint8_t counting = context->counting;
+    context->counting = 0;
+
     if (ch == 27) { // ESC
       context->input_window.focus = 0;
       context->input_window.cursor = 0;
+      tailess_set_prompt(context, PROMPT_SEARCH);
       updated = 1;
     } else if (ch == 23) { // CTRL + W
       if (context->input_window.focus && context->input_window.cursor > 0) {
@@ -384,20 +4269,43 @@ uint8_t handle_input(Tailess_Context* context) {
         }
       }
       updated = 1;
+    } else if (ch == 18) { // CTRL + R
+      context->regex = !context->regex;
+      tailess_set_prompt(context, context->prompt);
+
+      // Outside the prompt it applies to the current needle right away
+      Searcher* searcher = &context->list_window.searcher;
+      if (!context->input_window.focus && searcher_is_active(searcher)) {
+        char* needle = searcher->needle;
+        size_t size = searcher->size;
+        searcher->needle = NULL;
+        searcher_free(searcher);
+        searcher_compile(searcher, needle, size, context->regex);
+        match_index_reset(&context->list_window.matches);
+        free(needle);
+      }
+      updated = 1;
+    } else if (ch == '\n' && context->input_window.focus && context->prompt == PROMPT_FILTER) { //ENTER
+      context->input_window.focus = 0;
+      hui_set_filter_list_window(&context->list_window, context->input_window.buffer, context->input_window.cursor, context->regex);
+      context->input_window.cursor = 0;
+      tailess_set_prompt(context, PROMPT_SEARCH);
+      updated = 1;
+    } else if (ch == '\n' && context->input_window.focus && context->prompt == PROMPT_JUMP) { //ENTER
+      context->input_window.focus = 0;
+      tailess_jump(context, context->input_window.buffer, context->input_window.cursor);
+      context->input_window.cursor = 0;
+      tailess_set_prompt(context, PROMPT_SEARCH);
+      updated = 1;
     } else if (ch == '\n') { //ENTER
       context->input_window.focus = 0;
 
-      if (context->list_window.needle.line != 0) {
-        free(context->list_window.needle.line);
-        context->list_window.needle.line = 0;
-        context->list_window.needle.count = 0;
-      }
+      searcher_free(&context->list_window.searcher);
+      match_index_reset(&context->list_window.matches);
 
+      // The needle is compiled once here, n/N and the highlight reuse it
       if (context->input_window.cursor > 3) {
-        context->list_window.needle.line = malloc(sizeof(char) * (context->input_window.cursor + 1));
-        strncpy(context->list_window.needle.line, context->input_window.buffer, context->input_window.cursor);
-        context->list_window.needle.line[context->input_window.cursor] = '\0';
-        context->list_window.needle.count = context->input_window.cursor;
+        searcher_compile(&context->list_window.searcher, context->input_window.buffer, context->input_window.cursor, context->regex);
       }
 
       hui_go_to_next_occurrence(&context->list_window);
@@ -406,6 +4314,7 @@ uint8_t handle_input(Tailess_Context* context) {
     } else if (ch == 127) { //BACKSPACE
       if (!hui_input_pop_char(&context->input_window)) {
         context->input_window.focus = 0;
+        tailess_set_prompt(context, PROMPT_SEARCH);
       }
       updated = 1;
     } else if (context->input_window.focus && hui_input_push_char(&context->input_window, ch)) {
@@ -428,6 +4337,9 @@ uint8_t handle_input(Tailess_Context* context) {
       updated = 1;
       context->list_window.following = 0;
       hui_go_right_list_window(&context->list_window);
+    } else if (ch == 'w') {
+      updated = 1;
+      hui_toggle_wrap_list_window(&context->list_window);
     } else if (ch == 'N') {
       hui_go_to_previous_occurrence(&context->list_window);
       context->list_window.following = 0;
@@ -444,6 +4356,14 @@ uint8_t handle_input(Tailess_Context* context) {
       updated = 1;
       context->list_window.following = 0;
       hui_page_down_list_window(&context->list_window);
+    } else if (ch == 'G' && counting) {
+      updated = 1;
+      context->list_window.following = 0;
+      hui_go_to_line_list_window(&context->list_window, context->count > 0 ? context->count - 1 : 0);
+    } else if (ch == '%' && counting) {
+      updated = 1;
+      context->list_window.following = 0;
+      hui_go_to_percent_list_window(&context->list_window, context->count);
     } else if (ch == 'G') {
       updated = 1;
       context->list_window.following = 0;
@@ -455,6 +4375,14 @@ uint8_t handle_input(Tailess_Context* context) {
     } else if (ch == '/') {
       context->input_window.focus = 1;
       updated = 1;
+    } else if (ch == '&') {
+      context->input_window.focus = 1;
+      tailess_set_prompt(context, PROMPT_FILTER);
+      updated = 1;
+    } else if (ch == ':') {
+      context->input_window.focus = 1;
+      tailess_set_prompt(context, PROMPT_JUMP);
+      updated = 1;
     } else if (ch == 'f') {
       context->list_window.following = 1;
       updated = 1;
@@ -464,6 +4392,26 @@ uint8_t handle_input(Tailess_Context* context) {
   return updated;
 }
 
+/*
+ * A count with an optional K, M or G suffix, return 0 if it isn't one
+ */
+int parse_size(const char* text, size_t* size) {
+  char* end;
+  errno = 0;
+  unsigned long long value = strtoull(text, &end, 10);
+  if (errno || end == text || *text == '-') return 0;
+
+  switch (*end) {
+    case 'K': case 'k': value <<= 10; end++; break;
+    case 'M': case 'm': value <<= 20; end++; break;
+    case 'G': case 'g': value <<= 30; end++; break;
+  }
+
+  if (*end != '\0') return 0;
+  *size = value;
+  return 1;
+}
+
 int main(int argc, char** args) {
   Tailess_Context context = {0};
   context.fd[0].fd = STDIN_FILENO;
@@ -474,7 +4422,19 @@ int main(int argc, char** args) {
   context.numberFds = 2;
   uint8_t follow = 0;
   char* file_name = NULL;
-  
+  // More than one file are merged by time
+  char** file_names = malloc((argc + 1) * sizeof(char*));
+  assert(file_names && "Out of memory");
+  size_t files_count = 0;
+  size_t max_lines = 0;
+  size_t max_bytes = 0;
+  size_t window = 64 << 20;
+  size_t tail_lines = 0;
+  uint8_t spill = 0;
+  uint8_t index_cache = 0;
+  uint8_t stats = 0;
+  size_t fps = 60;
+
   // First is the program name, we don't care about it
   argc--;
   args++;
@@ -482,8 +4442,30 @@ int main(int argc, char** args) {
   for (int i = 0; i < argc; i++) {
     if (strcmp(args[i], "-f") == 0) {
       follow = 1;
+    } else if (strcmp(args[i], "--spill") == 0) {
+      spill = 1;
+    } else if (strcmp(args[i], "--index-cache") == 0) {
+      index_cache = 1;
+    } else if (strcmp(args[i], "--stats") == 0) {
+      stats = 1;
+    } else if (strcmp(args[i], "--fps") == 0) {
+      if (i + 1 >= argc || !parse_size(args[i + 1], &fps) || fps == 0) {
+        fprintf(stderr, "%s expects a number of frames per second\n", args[i]);
+        return 1;
+      }
+      i++;
+    } else if (strcmp(args[i], "-n") == 0 || strcmp(args[i], "--max-lines") == 0 || strcmp(args[i], "--max-bytes") == 0 || strcmp(args[i], "--window") == 0) {
+      size_t* limit = strcmp(args[i], "-n") == 0 ? &tail_lines :
+                      strcmp(args[i], "--max-lines") == 0 ? &max_lines :
+                      strcmp(args[i], "--max-bytes") == 0 ? &max_bytes : &window;
+      if (i + 1 >= argc || !parse_size(args[i + 1], limit)) {
+        fprintf(stderr, "%s expects a number, optionally followed by K, M or G\n", args[i]);
+        return 1;
+      }
+      i++;
     } else {
       file_name = args[i];
+      file_names[files_count++] = args[i];
     }
   }
 
@@ -495,59 +4477,157 @@ int main(int argc, char** args) {
       return 1;
     }
     context.fd[0].fd = input;
+  } else if (files_count > 1) {
+    for (size_t i = 0; i < files_count; i++) {
+      if (!merge_add(&context.merge, file_names[i])) {
+        fprintf(stderr, "Error opening %s: %s \n", file_names[i], strerror(errno));
+        return 1;
+      }
+    }
   } else if (file_name) {
-    FILE* fileinput = fopen(file_name, "r");
-    if (!fileinput) {
+    int fileinput = open(file_name, O_RDONLY | O_CLOEXEC);
+    if (fileinput < 0) {
       fprintf(stderr, "Error opening %s: %s \n", file_name, strerror(errno));
       return 1;
     }
-    context.fd[1].fd = fileno(fileinput);
+    context.fd[1].fd = fileinput;
   } else {
     fprintf(stderr, "You must redirect some info to the application\n");
     return 1;
   }
 
+  int spill_fd = -1;
+  if (spill && context.fd[1].fd == STDIN_FILENO) {
+    const char* dir = getenv("TMPDIR");
+    spill_fd = spill_create(dir && *dir ? dir : "/tmp");
+    if (spill_fd < 0) {
+      fprintf(stderr, "Error creating the spill file: %s \n", strerror(errno));
+      return 1;
+    }
+  }
+
   context.window = hui_init();
 
   int updated = 1;
+  // Keystrokes and resizes are drawn right away, new data waits for the next frame
+  uint8_t urgent = 1;
+  long frame_interval = 1000 / fps;
+  struct timespec last_frame = {0};
 
   context.list_window = hui_create_list_window(context.window.width, context.window.height - 2, 0, 0);
   context.input_window = hui_create_input_window(context.window.width, 1, context.window.height - 1, 0);
   context.message_window = hui_create_window(context.window.width, 1, context.window.height - 2, 0);
   context.list_window.following = follow;
+  // Only piped input grows without bounds, a mapped file is already on disk
+  context.list_window.lines.max_lines = max_lines;
+  context.list_window.lines.max_bytes = max_bytes;
+  context.list_window.lines.window = window;
+  if (spill_fd >= 0) lines_spill_to(&context.list_window.lines, spill_fd);
   hui_use_retain_mode();
 
+  // Regular files don't need to be read, only the keyboard and their changes are left to poll
+  if (file_name && context.fd[1].fd != STDIN_FILENO && lines_map_file(&context.list_window.lines, context.fd[1].fd)) {
+    follow_start(&context.follow, file_name, context.fd[1].fd);
+    if (index_cache) {
+      checkpoints_load(&context.list_window.lines, context.follow.fd);
+      // A file that only grew a bit since it was counted gets real line numbers right away
+      lines_count_slice(&context.list_window.lines, CHECKPOINT_SLICE);
+    }
+    context.fd[1].fd = context.follow.inotify;
+    context.numberFds = context.follow.inotify >= 0 ? 2 : 1;
+    // Both only look at the end of the file, however big it is
+    if (tail_lines) hui_tail_list_window(&context.list_window, tail_lines);
+    else if (follow) hui_end_list_window(&context.list_window);
+  }
+  if (context.merge.count) {
+    merge_start(&context.merge, &context.list_window.lines, follow);
+    context.fd[1].fd = context.merge.inotify;
+    context.numberFds = context.merge.inotify >= 0 ? 2 : 1;
+    if (follow) hui_end_list_window(&context.list_window);
+  } else if (!context.follow.active) {
+    if (!ingest_start(&context.ingest, context.fd[1].fd, context.list_window.lines.spilling)) {
+      fprintf(stderr, "Error starting the ingest thread: %s \n", strerror(errno));
+      return 1;
+    }
+    context.fd[1].fd = context.ingest.ready[0];
+  }
+
   while(1) {
+    long until_frame = -1;
+    if (updated && !urgent) {
+      long elapsed = elapsed_ms(&last_frame);
+      if (elapsed < frame_interval) until_frame = frame_interval - elapsed;
+    }
 
-    if (updated) {
+    if (updated && until_frame < 0) {
+      // Filtered rows show up as the background slices find them
+      if (!hui_list_is_filtered(&context.list_window)) {
+        lines_index_until(&context.list_window.lines, context.list_window.offset.y + context.list_window.height);
+      }
+      if (context.list_window.following && context.list_window.wrap) hui_end_list_window(&context.list_window);
       start_drawing();
       hui_draw_list_window(context.list_window);
       hui_draw_input_window(context.input_window);
       if (context.list_window.following) hui_put_text_at_window(context.message_window, "Following..", 11, 0, 0);
+      hui_draw_filter_status(&context.list_window, context.message_window);
+      hui_draw_match_status(&context.list_window, context.message_window);
+      if (stats && !context.input_window.focus) {
+        Hui_Input* input = &context.input_window;
+        hui_draw_frame_stats((Hui_Window) { .width = input->width, .height = input->height, .x = input->x, .y = input->y });
+      }
       end_drawing();
+      clock_gettime(CLOCK_MONOTONIC, &last_frame);
       updated = 0;
+      urgent = 0;
     }
 
-    int retval = poll(context.fd, context.numberFds, 1000);
+    // Don't sleep while an index is still being filled, nor past the next frame
+    int busy = hui_list_is_indexing(&context.list_window) || (index_cache && lines_is_counting(&context.list_window.lines)) ||
+               ingest_has_batches(&context.ingest);
+    int timeout = busy ? 0 : until_frame >= 0 ? (int) until_frame : 1000;
+    int retval = poll(context.fd, context.numberFds, timeout);
 
     if (retval == -1) {
+      // A resize interrupts the poll, draw it now rather than on the next wakeup
+      if (errno == EINTR && handle_hui_events(&context)) updated = urgent = 1;
       if (errno == EINTR) continue;
       return 1;
-    } else if (retval) {
-      updated = handle_input(&context);
+    }
+
+    // A file that shrank is reloaded before the keys get to read it
+    updated += handle_follow(&context);
+    updated += handle_merge(&context);
 
-      if (updated == 2) break;
+    if (retval) {
+      uint8_t input = handle_input(&context);
 
-      updated += handle_hui_events(&context);
+      if (input == 2) break;
+
+      input += handle_hui_events(&context);
+      if (input) urgent = 1;
+      updated += input;
+    }
 
-      updated += handle_read_data(&context); 
+    // Batches left over from the last turn are taken even when nothing woke us
+    updated += handle_read_data(&context);
 
+    updated += hui_index_matches_list_window(&context.list_window);
+    // The whole file is only counted ahead to be kept in the sidecar, :N and % count what they need
+    if (index_cache && lines_count_slice(&context.list_window.lines, CHECKPOINT_SLICE) && context.follow.active &&
+        !lines_is_counting(&context.list_window.lines)) {
+      checkpoints_save(&context.list_window.lines, context.follow.fd);
     }
+    hui_trim_list_window(&context.list_window);
     if (updated) {
       hui_clear_window();
     }
   }
+  search_pool_free();
+  if (index_cache && context.follow.active) checkpoints_save(&context.list_window.lines, context.follow.fd);
   hui_free_list_window(context.list_window);
+  follow_free(&context.follow);
+  merge_free(&context.merge);
+  free(file_names);
   kill(getpid(), SIGINT);
   return 0;
 }